@@ -24,6 +24,17 @@
 #include <stdarg.h>
 #include <time.h>
 #include <math.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include "basic.h"
 
 double drand48() {
@@ -36,6 +47,43 @@ long lrand48() {
 
 }
 
+/* Counter-based uniforms (Philox4x32-10, Salmon et al. 2011).  Each block of
+   four numbers is a keyed hash of its counter, so the stream for a given
+   (seed, a, b, c) is fixed no matter which thread asks for it or in what
+   order, and there is no state to lock or carry between calls. */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static inline void philox(uint32_t c[4], uint32_t k0, uint32_t k1)
+{
+	int i;
+	for(i=0;i<10;i++) {
+		uint64_t p0=(uint64_t)PHILOX_M0*c[0];
+		uint64_t p1=(uint64_t)PHILOX_M1*c[2];
+		uint32_t c1=c[1], c3=c[3];
+		c[0]=(uint32_t)(p1>>32)^c1^k0;
+		c[1]=(uint32_t)p1;
+		c[2]=(uint32_t)(p0>>32)^c3^k1;
+		c[3]=(uint32_t)p0;
+		k0+=PHILOX_W0;
+		k1+=PHILOX_W1;
+	}
+}
+
+// out[0..n-1] = uniforms in (0,1), stream (a,b,c) of seed
+void crng_uniform(double *out, int n, unsigned int seed, unsigned int a, unsigned int b, unsigned int c)
+{
+	int i, k;
+	for(i=0;i<n;i+=4) {
+		uint32_t x[4]={i>>2,a,b,c};
+		philox(x,seed,0x5eed);
+		for(k=0;k<4 && i+k<n;k++)
+			out[i+k]=(x[k]+0.5)*(1./4294967296.);
+	}
+}
+
 unsigned int uivmin(unsigned int *v, int n)
 {
 	unsigned int m=*v++;
@@ -79,6 +127,12 @@ void dvadd(double *v1,double *v2,int n)
 	for(i=0; i<n; i++) *v1++ += *v2++;
 }
 
+void fvadd(float *v1,float *v2,int n)
+{
+	int i;
+	for(i=0; i<n; i++) *v1++ += *v2++;
+}
+
 double fdvdot(float *v1, double *v2, int n)
 {
 	int i;
@@ -100,6 +154,21 @@ double ddvdot(double *v1, double *v2, int n)
 	return sum;
 }
 
+/* Single precision dot product kept in 8 partial sums.  Without -ffast-math
+   the compiler may not reorder a single running sum, this way the main loop
+   maps onto SIMD registers */
+float ffvdot(float *v1, float *v2, int n)
+{
+	float s[8]={0.,0.,0.,0.,0.,0.,0.,0.};
+	int i,k;
+	for(i=0;i+8<=n;i+=8)
+		for(k=0;k<8;k++)
+			s[k]+=v1[i+k]*v2[i+k];
+	for(;i<n;i++)
+		s[0]+=v1[i]*v2[i];
+	return ((s[0]+s[4])+(s[1]+s[5]))+((s[2]+s[6])+(s[3]+s[7]));
+}
+
 double fdvwdot(float *v1, double *v2, int n,double *wgt)
 {
 	int i;
@@ -144,6 +213,45 @@ double fvsqr(float *v, int n)
 	return sum;
 }
 
+/* exp(x) written so that gcc vectorizes loops calling it: x=n*ln2+r with
+   |r|<=ln2/2, exp(r) from its degree 11 Taylor series and 2^n put straight
+   into the exponent bits.  x is clamped to +-708.  The relative error
+   against libm exp() is below 1e-14 over the whole range. */
+static inline double fexp(double x)
+{
+	union { double d; uint64_t i; } u;
+	double t,r,p;
+	x=x<-708.?-708.:x;
+	x=x>708.?708.:x;
+	t=x*1.4426950408889634+6755399441055744.;	/* 1.5*2^52 leaves round(x/ln2) in the low bits */
+	u.d=t;
+	t-=6755399441055744.;
+	r=x-t*6.93147180369123816490e-01-t*1.90821492927058770002e-10;
+	p=1.+r*(1.+r*(1./2+r*(1./6+r*(1./24+r*(1./120+r*(1./720+r*(1./5040
+		+r*(1./40320+r*(1./362880+r*(1./3628800+r*(1./39916800)))))))))));
+	u.i=(u.i+1023)<<52;
+	return p*u.d;
+}
+
+/* Sigmoid and normalize n groups of k logits in place: x[i]=1/(1+exp(-x[i]))
+   and then each group is scaled to sum to 1 (unless the sum is 0).  Used for
+   the softmax visible units of the RBMs, k=5 per movie.  The results are
+   within 2e-14 relative of the libm exp() and division version. */
+void vsoftsig(double *x, int n, int k)
+{
+	int i,j;
+	for(i=0;i<n*k;i++)
+		x[i]=1./(1.+fexp(-x[i]));
+	for(i=0;i<n;i++,x+=k) {
+		double s=0.;
+		for(j=0;j<k;j++) s+=x[j];
+		if(s!=0.) {
+			s=1./s;
+			for(j=0;j<k;j++) x[j]*=s;
+		}
+	}
+}
+
 FILE *lgfile=NULL;
 void lg(char *fmt,...)
 {
@@ -188,6 +296,232 @@ void lgopen(int argc, char**argv)
 	lg("\n");
 }
 
+/* Wall clock time in seconds, for reporting next to clock() which only
+   counts CPU time summed over all threads */
+double wtime()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+1.e-6*tv.tv_usec;
+}
+
+/* Phase timers.  With prof set, code brackets its phases with
+   PH_START(&c,t) and PH_LAP(&c,t,phase) on thread t: each lap adds the
+   wall time (and with -perf the CPU cycles and last level cache misses of
+   the thread) since the previous start or lap to the phase.  prof_report()
+   logs the sums over all threads as one JSON line and clears them, so the
+   seconds are thread seconds.  Each lap costs a clock_gettime(), and a
+   read() of the counters with -perf, so phases are laps of whole steps of
+   a user, not of single ratings. */
+int prof=0;
+static char *ph_names[NPHASES]={"up","down","sample","cd","update","rmse","io"};
+static struct phacc {
+	double sec[NPHASES];
+	unsigned long long n[NPHASES][2];	/* cycles, LLC misses */
+	unsigned long long last[2];
+	int fd[2];			/* group leader and member, -1 if none */
+	pthread_t owner;
+} ph_acc[MAXTHREADS];
+static int ph_counters=0;
+static double ph_t0;		/* of the previous report */
+
+static double ph_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+1.e-9*ts.tv_nsec;
+}
+
+void prof_open(int counters)
+{
+	int t;
+	prof=1;
+	ph_counters=counters;
+	ph_t0=ph_now();
+	for(t=0;t<MAXTHREADS;t++)
+		ph_acc[t].fd[0]=ph_acc[t].fd[1]=-1;
+#ifndef __linux__
+	if(counters) lg("No hardware counters on this system\n");
+	ph_counters=0;
+#endif
+}
+
+/* Cycles and LLC misses of the calling thread, opened on its first use.  If
+   they cannot be opened (no permission, a VM) the thread reports zeros. */
+static void ph_read(struct phacc *a, unsigned long long *v)
+{
+	v[0]=v[1]=0;
+#ifdef __linux__
+	if(!ph_counters) return;
+	if(a->fd[0]==-1 || !pthread_equal(a->owner,pthread_self())) {
+		struct perf_event_attr pe;
+		int k;
+		unsigned long long cfg[2]={PERF_COUNT_HW_CPU_CYCLES,PERF_COUNT_HW_CACHE_MISSES};
+		for(k=0;k<2;k++) {
+			if(a->fd[k]>=0) close(a->fd[k]);
+			a->fd[k]=-1;
+		}
+		a->owner=pthread_self();
+		for(k=0;k<2;k++) {
+			memset(&pe,0,sizeof(pe));
+			pe.size=sizeof(pe);
+			pe.type=PERF_TYPE_HARDWARE;
+			pe.config=cfg[k];
+			pe.exclude_kernel=1;
+			pe.exclude_hv=1;
+			pe.read_format=PERF_FORMAT_GROUP;
+			a->fd[k]=syscall(__NR_perf_event_open,&pe,0,-1,a->fd[0],0);
+			if(a->fd[k]<0) break;
+		}
+		if(a->fd[0]<0) {
+			static int warned=0;
+			if(!warned++) lg("Cant open hardware counters (perf_event_paranoid?)\n");
+			a->fd[0]=-2;	/* do not try again on this thread */
+			return;
+		}
+	}
+	if(a->fd[0]>=0) {
+		unsigned long long buf[3];
+		if(read(a->fd[0],buf,sizeof(buf))>=(ssize_t)(2*sizeof(buf[0]))) {
+			v[0]=buf[1];
+			v[1]=buf[0]>1 ? buf[2] : 0;
+		}
+	}
+#endif
+}
+
+void ph_start(double *c, int t)
+{
+	ph_read(&ph_acc[t],ph_acc[t].last);
+	*c=ph_now();
+}
+
+void ph_lap(double *c, int t, int ph)
+{
+	struct phacc *a=&ph_acc[t];
+	unsigned long long v[2];
+	double now=ph_now();
+	a->sec[ph]+=now-*c;
+	*c=now;
+	ph_read(a,v);
+	a->n[ph][0]+=v[0]-a->last[0];
+	a->n[ph][1]+=v[1]-a->last[1];
+	a->last[0]=v[0];
+	a->last[1]=v[1];
+}
+
+/* One line of JSON with the phases of epoch (0 for the final pass) and the
+   wall time since the previous line */
+void prof_report(char *model, int epoch)
+{
+	char buf[2048];
+	int n,t,ph;
+	double now;
+	if(!prof) return;
+	now=ph_now();
+	n=sprintf(buf,"{\"model\":\"%s\",\"epoch\":%d,\"wall\":%.6f,\"phases\":{",model,epoch,now-ph_t0);
+	ph_t0=now;
+	for(ph=0;ph<NPHASES;ph++) {
+		double sec=0.;
+		unsigned long long cyc=0,llc=0;
+		for(t=0;t<MAXTHREADS;t++) {
+			sec+=ph_acc[t].sec[ph];
+			cyc+=ph_acc[t].n[ph][0];
+			llc+=ph_acc[t].n[ph][1];
+			ph_acc[t].sec[ph]=0.;
+			ph_acc[t].n[ph][0]=ph_acc[t].n[ph][1]=0;
+		}
+		n+=sprintf(buf+n,"%s\"%s\":{\"sec\":%.6f",ph ? "," : "",ph_names[ph],sec);
+		if(ph_counters)
+			n+=sprintf(buf+n,",\"cycles\":%llu,\"llc_misses\":%llu",cyc,llc);
+		n+=sprintf(buf+n,"}");
+	}
+	lg("%s}}\n",buf);
+}
+
+/* Persistent worker pool used by parallel().  The calling thread runs as
+   thread 0 and n-1 workers wait on a barrier between calls, so it is
+   cheap enough to call once per minibatch. Calls must not be nested. */
+static pthread_t pool_threads[MAXTHREADS];
+static pthread_barrier_t pool_start, pool_done;
+static int pool_n=1;
+static int pool_quit=0;
+static parfunc pool_f;
+static void *pool_arg;
+
+static void *pool_main(void *p)
+{
+	int t=(int)(long)p;
+	for(;;) {
+		pthread_barrier_wait(&pool_start);
+		if(pool_quit) break;
+		pool_f(pool_arg,t,pool_n);
+		pthread_barrier_wait(&pool_done);
+	}
+	return NULL;
+}
+
+static void pool_stop()
+{
+	int t;
+	if(pool_n<=1) return;
+	pool_quit=1;
+	pthread_barrier_wait(&pool_start);
+	for(t=1;t<pool_n;t++)
+		pthread_join(pool_threads[t],NULL);
+	pthread_barrier_destroy(&pool_start);
+	pthread_barrier_destroy(&pool_done);
+	pool_quit=0;
+	pool_n=1;
+}
+
+void parallel(int n, parfunc f, void *arg)
+{
+	if(n<=1) {
+		f(arg,0,1);
+		return;
+	}
+	if(n>MAXTHREADS) error("Too many threads %d\n",n);
+	if(n!=pool_n) {
+		int t;
+		pool_stop();
+		pthread_barrier_init(&pool_start,NULL,n);
+		pthread_barrier_init(&pool_done,NULL,n);
+		pool_n=n;
+		for(t=1;t<n;t++)
+			if(pthread_create(&pool_threads[t],NULL,pool_main,(void*)(long)t))
+				error("Cant create thread %d\n",t);
+	}
+	pool_f=f;
+	pool_arg=arg;
+	pthread_barrier_wait(&pool_start);
+	f(arg,0,n);
+	pthread_barrier_wait(&pool_done);
+}
+
+/* Arena for arrays whose size is only known at startup.  Run the same
+   carving code twice: while a->base is NULL arena_get() only adds up the
+   sizes, then arena_alloc() allocates one zeroed block and the second pass
+   hands out 64 byte aligned pieces of it.  Nothing is ever freed. */
+void *arena_get(struct arena *a, size_t len)
+{
+	len=(len+63)&~(size_t)63;
+	a->used+=len;
+	if(!a->base) return NULL;
+	if(a->used>a->size) error("Arena overflow %lu > %lu\n",(unsigned long)a->used,(unsigned long)a->size);
+	return a->base+a->used-len;
+}
+
+void arena_alloc(struct arena *a)
+{
+	char *p;
+	a->size=a->used;
+	a->used=0;
+	p=calloc(a->size+64,1);
+	if(!p) error("Cant allocate %lu bytes\n",(unsigned long)a->size);
+	a->base=p+(64-((size_t)p&63));
+}
+
 void load_bin(char *path, void *data, int len)
 {
     FILE *fp;
@@ -204,16 +538,212 @@ void load_bin(char *path, void *data, int len)
     fclose(fp);
 }
 
+// Map a binary file of exactly len bytes instead of reading it.  A read only
+// mapping (cow=0) shares the page cache with every other process that maps
+// the same file, so repeated runs start without copying the data.  With cow
+// set the mapping is private and writable: pages are copied on their first
+// write and the file itself is never changed.
+void *map_bin(char *path, size_t len, int cow)
+{
+	struct stat st;
+	void *data;
+	int fd;
+	lg("Mapping %s\n",path);
+	fd=open(path,O_RDONLY);
+	if(fd<0) {
+		lg("Cant open file\n");
+		exit(1);
+	}
+	if(fstat(fd,&st) || st.st_size!=len) {
+		lg("File size does not match, expected %lu bytes\n",(unsigned long)len);
+		exit(1);
+	}
+	data=mmap(NULL,len,cow?PROT_READ|PROT_WRITE:PROT_READ,cow?MAP_PRIVATE:MAP_SHARED,fd,0);
+	if(data==MAP_FAILED) {
+		lg("Failed to map file\n");
+		exit(1);
+	}
+	close(fd);
+	return data;
+}
+
+void unmap_bin(void *data, size_t len)
+{
+	if(munmap(data,len))
+		lg("Failed to unmap\n");
+}
+
+// The data is written to path.tmp and renamed over path, so a file that is
+// still mapped (-le x -se x) keeps its old contents until it is unmapped.
 void dump_bin(char *path, void *data, int len)
 {
     FILE *fp;
+    char tmp[1024];
     lg("Writing %s\n",path);
-    fp=fopen(path,"wb");
-    if(len!=fwrite(data,1,len,fp)) {
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    fp=fopen(tmp,"wb");
+    if(!fp || len!=fwrite(data,1,len,fp) || fclose(fp)) {
         lg("Failed to write all data\n");
         exit(1);
     }
-    fclose(fp);
+    if(rename(tmp,path)) {
+        lg("Failed to rename %s\n",tmp);
+        exit(1);
+    }
+}
+
+/* dump_bin() from a background thread.  The caller hands over data, which
+   is freed once written; only one such write is in flight, the next call
+   (or dump_wait()) waits for the previous one to finish. */
+struct dumpjob {
+	char *path;
+	void *data;
+	size_t len;
+};
+static pthread_t dump_thread;
+static int dump_busy=0;
+
+static void *dump_job(void *arg)
+{
+	struct dumpjob *j=arg;
+	char tmp[1024];
+	FILE *fp;
+	snprintf(tmp,sizeof(tmp),"%s.tmp",j->path);
+	fp=fopen(tmp,"wb");
+	if(!fp || j->len!=fwrite(j->data,1,j->len,fp) || fclose(fp))
+		error("Failed to write %s\n",tmp);
+	if(rename(tmp,j->path))
+		error("Failed to rename %s\n",tmp);
+	free(j->path);
+	free(j->data);
+	free(j);
+	return NULL;
+}
+
+void dump_wait()
+{
+	if(dump_busy)
+		pthread_join(dump_thread,NULL);
+	dump_busy=0;
+}
+
+void dump_bin_async(char *path, void *data, size_t len)
+{
+	struct dumpjob *j=malloc(sizeof(*j));
+	dump_wait();
+	lg("Writing %s\n",path);
+	j->path=strdup(path);
+	j->data=data;
+	j->len=len;
+	if(pthread_create(&dump_thread,NULL,dump_job,j))
+		error("Cant start writer thread\n");
+	dump_busy=1;
+}
+
+/* Background file writer.  stream_write() copies into one of two buffers
+   and, when it is full, hands it to a writer thread and goes on filling the
+   other one, so the caller only waits when the disk is a whole buffer behind.
+   Like dump_bin() the file is written as path.tmp and renamed on close. */
+#define STREAMBUF (16<<20)
+struct stream {
+	FILE *fp;
+	char *path, tmp[1024];
+	char *buf[2];
+	size_t len[2];
+	int cur;		// buffer being filled
+	int pending;	// buffer waiting for or being written, -1 if none
+	int done, failed;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *stream_thread(void *arg)
+{
+	struct stream *s=arg;
+	pthread_mutex_lock(&s->lock);
+	for(;;) {
+		while(s->pending<0 && !s->done)
+			pthread_cond_wait(&s->cond,&s->lock);
+		if(s->pending<0)
+			break;
+		int b=s->pending;
+		pthread_mutex_unlock(&s->lock);
+		if(s->len[b]!=fwrite(s->buf[b],1,s->len[b],s->fp))
+			s->failed=1;
+		pthread_mutex_lock(&s->lock);
+		s->pending=-1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+struct stream *stream_open(char *path)
+{
+	struct stream *s=calloc(1,sizeof(*s));
+	lg("Writing %s\n",path);
+	s->path=path;
+	snprintf(s->tmp,sizeof(s->tmp),"%s.tmp",path);
+	s->fp=fopen(s->tmp,"wb");
+	s->buf[0]=malloc(STREAMBUF);
+	s->buf[1]=malloc(STREAMBUF);
+	if(!s->fp || !s->buf[0] || !s->buf[1])
+		error("Cant open %s\n",s->tmp);
+	s->pending=-1;
+	pthread_mutex_init(&s->lock,NULL);
+	pthread_cond_init(&s->cond,NULL);
+	if(pthread_create(&s->thread,NULL,stream_thread,s))
+		error("Cant start writer thread\n");
+	return s;
+}
+
+// Hand the current buffer to the writer thread and switch to the other one
+static void stream_flush(struct stream *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while(s->pending>=0)
+		pthread_cond_wait(&s->cond,&s->lock);
+	s->pending=s->cur;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	s->cur^=1;
+	s->len[s->cur]=0;
+}
+
+void stream_write(struct stream *s, void *data, size_t len)
+{
+	char *p=data;
+	while(len) {
+		size_t n=STREAMBUF-s->len[s->cur];
+		if(n>len) n=len;
+		memcpy(s->buf[s->cur]+s->len[s->cur],p,n);
+		s->len[s->cur]+=n;
+		p+=n;
+		len-=n;
+		if(s->len[s->cur]==STREAMBUF)
+			stream_flush(s);
+	}
+}
+
+void stream_close(struct stream *s)
+{
+	if(s->len[s->cur])
+		stream_flush(s);
+	pthread_mutex_lock(&s->lock);
+	s->done=1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread,NULL);
+	if(fclose(s->fp) || s->failed)
+		error("Failed to write all data\n");
+	if(rename(s->tmp,s->path))
+		error("Failed to rename %s\n",s->tmp);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s->buf[0]);
+	free(s->buf[1]);
+	free(s);
 }
 
 void ddump_bin(char *fname,double *vec,int M,int N,int N1)
@@ -19,23 +19,72 @@
 ########################################################################
 */
 #define ZERO(v) memset(v,0,sizeof(v))
+
+/* Log to stderr and data/log.txt, error() also exits */
+void lg(char *fmt, ...);
+void error(char *fmt, ...);
+void lgopen(int argc, char **argv);
+
 void load_bin(char *path, void *data, int len);
 int dload_bin(char *fname,double *vec,int M,int N1);
 
+void *map_bin(char *path, size_t len, int cow);
+void unmap_bin(void *data, size_t len);
 void dump_bin(char *path, void *data, int len);
+void dump_bin_async(char *path, void *data, size_t len);
+void dump_wait();
 void ddump_bin(char *fname,double *vec,int M,int N,int N1);
 
+/* Write a file from a background thread, see stream_write() */
+struct stream;
+struct stream *stream_open(char *path);
+void stream_write(struct stream *s, void *data, size_t len);
+void stream_close(struct stream *s);
+
 int days(int year, int month, int day);
 
 unsigned int uivmin(unsigned int *v, int n);
 double dvavg(double *v, int n);
 double fdvdot(float *v1, double *v2, int n);
 double ddvdot(double *v1, double *v2, int n);
+float ffvdot(float *v1, float *v2, int n);
 double fdvwdot(float *v1, double *v2, int n,double *wgt);
+void dvadd(double *v1,double *v2,int n);
+void fvadd(float *v1,float *v2,int n);
 double dvsqr(double *v, int n);
 double dvwsqr(double *v, int n, double *wgt);
 double fvsqr(float *v, int n);
+void vsoftsig(double *x, int n, int k);
 double gauss();
+void crng_uniform(double *out, int n, unsigned int seed, unsigned int a, unsigned int b, unsigned int c);
+double wtime();
+
+/* Run f(arg,t,n) for t=0..n-1 on n threads and wait for all of them */
+#define MAXTHREADS (256)
+typedef void (*parfunc)(void *arg, int t, int n);
+void parallel(int n, parfunc f, void *arg);
+
+/* Phase timers (-prof) and hardware counters (-perf), see ph_lap() */
+#define PH_UP		0
+#define PH_DOWN		1
+#define PH_SAMPLE	2
+#define PH_CD		3
+#define PH_UPDATE	4
+#define PH_RMSE		5
+#define PH_IO		6
+#define NPHASES		7
+extern int prof;
+void prof_open(int counters);
+void ph_start(double *c, int t);
+void ph_lap(double *c, int t, int ph);
+void prof_report(char *model, int epoch);
+#define PH_START(c,t)	do { if(prof) ph_start(c,t); } while(0)
+#define PH_LAP(c,t,ph)	do { if(prof) ph_lap(c,t,ph); } while(0)
+
+/* One zeroed block carved into aligned arrays, see arena_get() */
+struct arena { char *base; size_t size, used; };
+void *arena_get(struct arena *a, size_t len);
+void arena_alloc(struct arena *a);
     
 #define EPS (1.e-20)
 #define INF (1.e20)
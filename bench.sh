@@ -0,0 +1,55 @@
+#!/bin/sh
+# Run by "make bench" in bench/.  Writes synthetic data with gen, times the
+# kernels of basic.c and then each model for a fixed number of epochs (the
+# argument, 2 by default) and the blend of their residuals.  Every run's log
+# is left in bench/<name>.log.
+EPOCHS=${1:-2}
+
+run() {
+	name=$1
+	shift
+	if ! "$@" > $name.log 2>&1; then
+		tail $name.log
+		echo "$name failed, see bench/$name.log"
+		exit 1
+	fi
+}
+
+# Epochs, seconds per epoch and train ratings per second from the -prof
+# lines, and the peak RSS, of the log of a model
+report() {
+	awk -v name=$1 '
+	/^Train=/ { split($1,a,"="); train=a[2] }
+	/^{"model"/ && !/"epoch":0,/ {
+		match($0,/"wall":[0-9.]+/)
+		wall+=substr($0,RSTART+7,RLENGTH-7)
+		n++
+	}
+	/^Peak RSS/ { rss=$3 }
+	END { printf "%-10s %6d %10.3f %12.0f %8d\n",name,n,wall/n,train*n/wall,rss }' $1.log
+}
+
+run gen ./gen
+grep "^Generating\|^Ratings\|^Most\|^Wrote" gen.log
+echo
+run kbench ./kbench
+grep "M/sec" kbench.log
+echo
+printf "%-10s %6s %10s %12s %8s\n" model epochs sec/epoch ratings/sec "RSS MB"
+for m in rbm rbmcond ubest; do
+	run $m ./$m -l 1 -epochs $EPOCHS -prof -se data/$m.bin
+	report $m
+done
+
+# The blend of the three, fit on probe and applied to every entry.  Its
+# columns are the files, the seconds and entries times files per second.
+run mix2 ./ubest -l 0 -le data/rbm.bin -le data/rbmcond.bin -le data/ubest.bin -se data/blend.bin
+awk '
+/^Train=/ { split($0,a,"[= ]"); entries=a[2]+a[4]+a[6] }
+match($0,/Blended [0-9]+ files in [0-9.]+/) {
+	split(substr($0,RSTART,RLENGTH),a," ")
+	n=a[2]
+	sec=a[5]
+}
+/^Peak RSS/ { rss=$3 }
+END { printf "%-10s %6d %10.3f %12.0f %8d\n","mix2",n,sec,entries*n/sec,rss }' mix2.log
@@ -0,0 +1,317 @@
+/*
+########################################################################
+#  Netflix Prize Tools
+#  Copyright (C) 2009 Greg Bildson
+#  http://code.google.com/p/nprizeadditions/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+########################################################################
+*/
+/*   gen.c
+     Writes a synthetic data/user_index.bin, data/user_entry.bin and
+     data/qualify.bin shaped like the Netflix data, for running and timing
+     the models where the real files are not at hand.  The sizes are the
+     ones of netflix.h, so built as is gen writes a full size set and built
+     with -DBENCH_USERS (see "make bench") a smaller one.
+
+     The number of ratings of a user follows a power law (Pareto, exponent
+     USERALPHA) and the popularity of a movie a Zipf-Mandelbrot law, so
+     there are a few heavy users and blockbusters and long tails of both.
+     The popularity ranks are spread over the movie ids at random.  A rating
+     is a rounded 3.6 plus user and movie biases, a KLATENT factor product
+     and noise, which gives roughly the real histogram and leaves the models
+     something to learn.  Each user rates from a random day to MAX_DAY and
+     the latest ratings are held out as probe and qualify entries, as in the
+     real data.  Only the NMOVIES_QUALIFY most popular movies are held out
+     as qualify entries, and qualify.bin lists every one of them, those no
+     user drew with no users, so that it has exactly NQUALIFY_SIZE entries.
+
+     The entries are laid out as in netflix.h: the movie in the low
+     USER_LMOVIEMASK bits, the rating-1 above them and the day from
+     USER_LDAY up, and each user's train, probe and qualify entries follow
+     each other in that order, by day within each.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "basic.h"
+#include "netflix.h"
+
+#define USERALPHA	(2.4)	// exponent of the ratings per user
+#define MOVIEZIPF	(2.0)	// exponent of the movie popularity
+#define KLATENT		(8)
+#define NMIN		(2)	// ratings of a user
+#define NCAP		(NMOVIES/2)
+
+int useridx[NUSERS][4];
+int nrate[NUSERS];		// ratings of each user
+int nhold[NUSERS];		// of which held out for probe and qualify
+int rank2movie[NMOVIES];
+int movierank[NMOVIES];
+double cdf[NMOVIES];		// of the popularity by rank
+float mbias[NMOVIES];
+float mfac[NMOVIES][KLATENT];
+int stamp[NMOVIES];		// u+1 once user u rated the movie
+int mcount[NMOVIES];		// ratings of each movie
+int qmovie[NQUALIFY];		// the qualify entries in user order
+int quser[NQUALIFY];
+
+// A movie drawn by popularity
+int draw_movie()
+{
+	double t=drand48()*cdf[NMOVIES-1];
+	int lo=0,hi=NMOVIES-1;
+	while(lo<hi) {
+		int mid=(lo+hi)/2;
+		if(cdf[mid]<t) lo=mid+1;
+		else hi=mid;
+	}
+	return rank2movie[lo];
+}
+
+// Add or take one from the users' counts v, round robin, until they sum to
+// total.  Each stays between NMIN and NCAP, or 0 and hi[u] if hi is given.
+void fit_counts(int *v, long long sum, long long total, int *hi)
+{
+	int u=0;
+	while(sum!=total) {
+		int d=sum<total ? 1 : -1;
+		int lo=hi ? 0 : NMIN;
+		int top=hi ? hi[u] : NCAP;
+		if(v[u]+d>=lo && v[u]+d<=top) {
+			v[u]+=d;
+			sum+=d;
+		}
+		u=(u+1)%NUSERS;
+	}
+}
+
+void setup_counts()
+{
+	double *x=malloc(NUSERS*sizeof(double));
+	double sum=0.;
+	long long n=0,nh=0;
+	int u;
+	if(!x) error("Cant allocate user counts\n");
+	if((long long)NMIN*NUSERS>NENTRIES || (long long)NCAP*NUSERS<NENTRIES)
+		error("Cant spread %d entries over %d users\n",NENTRIES,NUSERS);
+	for(u=0;u<NUSERS;u++) {
+		x[u]=pow(1.-drand48(),-1./(USERALPHA-1.));
+		sum+=x[u];
+	}
+	for(u=0;u<NUSERS;u++) {
+		nrate[u]=(int)(x[u]*NENTRIES/sum);
+		if(nrate[u]<NMIN) nrate[u]=NMIN;
+		if(nrate[u]>NCAP) nrate[u]=NCAP;
+		n+=nrate[u];
+	}
+	fit_counts(nrate,n,NENTRIES,NULL);
+
+	// The latest ratings of every user, but at least one train rating, are
+	// held out, the same number for all as far as they go
+	int *top=malloc(NUSERS*sizeof(int));
+	if(!top) error("Cant allocate user counts\n");
+	for(u=0;u<NUSERS;u++) {
+		top[u]=nrate[u]-1;
+		nhold[u]=(NPROBE+NQUALIFY)/NUSERS;
+		if(nhold[u]>top[u]) nhold[u]=top[u];
+		nh+=nhold[u];
+	}
+	n=0;
+	for(u=0;u<NUSERS;u++) n+=top[u];
+	if(n<NPROBE+NQUALIFY) error("Too few entries for %d probe and qualify\n",NPROBE+NQUALIFY);
+	fit_counts(nhold,nh,NPROBE+NQUALIFY,top);
+	free(top);
+	free(x);
+}
+
+void setup_movies()
+{
+	int k,m;
+	randperm(rank2movie,NMOVIES);
+	for(k=0;k<NMOVIES;k++) {
+		movierank[rank2movie[k]]=k;
+		cdf[k]=(k ? cdf[k-1] : 0.)+pow(k+1.+NMOVIES/36,-MOVIEZIPF);
+	}
+	for(m=0;m<NMOVIES;m++) {
+		// popular movies are rated a little higher
+		mbias[m]=0.45*gauss()+0.4*(0.5-movierank[m]/(double)NMOVIES);
+		for(k=0;k<KLATENT;k++)
+			mfac[m][k]=0.35*gauss();
+	}
+}
+
+// Rating-1 of a user with bias ub and factors uf for movie m
+int draw_rating(double ub, float *uf, int m)
+{
+	double s=3.6+ub+mbias[m]+0.8*gauss();
+	int k,r;
+	for(k=0;k<KLATENT;k++)
+		s+=uf[k]*mfac[m][k];
+	r=(int)floor(s+0.5);
+	if(r<1) r=1;
+	if(r>5) r=5;
+	return r-1;
+}
+
+int main(int argc, char**argv)
+{
+	unsigned int *ent=malloc(NCAP*sizeof(int));
+	unsigned int *tmp=malloc(NCAP*sizeof(int));
+	int *pos=malloc(NCAP*sizeof(int));
+	long long nhcum=0;
+	long long hist[5];
+	int seed=1,qn=0,qcarry=0;
+	int i,u,k,m;
+	lgopen(argc,argv);
+	for(i=1;i<argc;i++) {
+		if(!strcmp(argv[i],"-seed"))
+			seed=atoi(argv[++i]);
+		else {
+			lg("Unrecognized argument %d %s ?\n",i,argv[i]);
+			lg("-seed <n> - random seed\n");
+			exit(0);
+		}
+	}
+	if(!ent || !tmp || !pos) error("Cant allocate user entries\n");
+	if(NMOVIES>USER_MOVIEMASK+1 || NUSERS>MOVIE_USERMASK+1)
+		error("%d movies and %d users do not fit the entry layout\n",NMOVIES,NUSERS);
+	lg("Generating %d users, %d movies, %d entries (%d probe, %d qualify)\n",
+		NUSERS,NMOVIES,NENTRIES,NPROBE,NQUALIFY);
+	double wt0=wtime();
+	srand48(seed);
+	setup_movies();
+	setup_counts();
+	ZERO(hist);
+
+	struct stream *s=stream_open("data/user_entry.bin");
+	long long base=0;
+	for(u=0;u<NUSERS;u++) {
+		int n=nrate[u],h=nhold[u];
+		double ub=0.45*gauss();
+		float uf[KLATENT];
+		for(k=0;k<KLATENT;k++)
+			uf[k]=0.35*gauss();
+		int day0=MIN_DAY+(int)((MAX_DAY-MIN_DAY+1)*drand48());
+
+		for(i=0;i<n;i++) {
+			int tries=0;
+			do {
+				// the tail of the popularity is slow to draw from, so a
+				// heavy user's last movies are picked uniformly
+				m=tries++<20 ? draw_movie() : (int)(lrand48()%NMOVIES);
+			} while(stamp[m]==u+1);
+			stamp[m]=u+1;
+			int r=draw_rating(ub,uf,m);
+			int day=day0+(int)((MAX_DAY-day0+1)*drand48());
+			ent[i]=m|(r<<USER_LMOVIEMASK)|(day<<USER_LDAY);
+			hist[r]++;
+			mcount[m]++;
+		}
+		uquickSort(ent,n);	// by day, which is in the high bits
+
+		// The share of the held out ratings that are qualify entries, with
+		// what earlier users could not take
+		int want=(int)((nhcum+h)*NQUALIFY/(NPROBE+NQUALIFY)-nhcum*NQUALIFY/(NPROBE+NQUALIFY))+qcarry;
+		nhcum+=h;
+
+		// Mark qualify entries among the held out ratings of movies in the
+		// qualify set, swapping in the latest such train ratings if needed
+		int t=n-h,nq=0,swapped=0;
+		memset(pos,0,n*sizeof(int));
+		for(i=n-1;i>=t && nq<want;i--)
+			if(movierank[ent[i]&USER_MOVIEMASK]<NMOVIES_QUALIFY) {
+				pos[i]=1;
+				nq++;
+			}
+		for(i=t-1,k=n-1;i>=0 && nq<want;i--) {
+			if(movierank[ent[i]&USER_MOVIEMASK]>=NMOVIES_QUALIFY) continue;
+			while(k>=t && pos[k]) k--;
+			if(k<t) break;
+			unsigned int e=ent[i];
+			ent[i]=ent[k];
+			ent[k]=e;
+			pos[k]=1;
+			nq++;
+			swapped=1;
+		}
+		// the ratings swapped in leave the train ones out of day order
+		if(swapped) uquickSort(ent,t);
+		qcarry=want-nq;
+
+		// train, probe, qualify
+		int np=0;
+		for(i=t;i<n;i++)
+			if(!pos[i]) tmp[np++]=ent[i];
+		for(i=t;i<n;i++)
+			if(pos[i]) {
+				tmp[np++]=ent[i];
+				if(qn>=NQUALIFY) error("Too many qualify entries\n");
+				qmovie[qn]=ent[i]&USER_MOVIEMASK;
+				quser[qn++]=u;
+			}
+		uquickSort(tmp,np-nq);
+		uquickSort(tmp+np-nq,nq);
+		memcpy(ent+t,tmp,h*sizeof(int));
+		useridx[u][0]=(int)base;
+		useridx[u][1]=t;
+		useridx[u][2]=h-nq;
+		useridx[u][3]=nq;
+		base+=n;
+		stream_write(s,ent,n*sizeof(int));
+		PROGRESS(u,NUSERS);
+	}
+	stream_close(s);
+	if(qcarry || qn!=NQUALIFY)
+		error("Placed %d of %d qualify entries\n",qn,NQUALIFY);
+	dump_bin("data/user_index.bin",useridx,sizeof(useridx));
+
+	// qualify.bin: each movie of the qualify set, the number of its users
+	// and the users
+	int *mstart=calloc(NMOVIES+1,sizeof(int));
+	unsigned int *q=malloc(NQUALIFY_SIZE*sizeof(int));
+	if(!mstart || !q) error("Cant allocate qualify\n");
+	for(i=0;i<qn;i++)
+		mstart[qmovie[i]+1]++;
+	for(m=0;m<NMOVIES;m++)
+		mstart[m+1]+=mstart[m];
+	int *users=malloc((qn+1)*sizeof(int));
+	if(!users) error("Cant allocate qualify\n");
+	for(i=0;i<qn;i++)
+		users[mstart[qmovie[i]]++]=quser[i];
+	for(m=NMOVIES;m>0;m--)
+		mstart[m]=mstart[m-1];
+	mstart[0]=0;
+	int nqs=0;
+	for(m=0;m<NMOVIES;m++) {
+		if(movierank[m]>=NMOVIES_QUALIFY) continue;
+		q[nqs++]=m;
+		q[nqs++]=mstart[m+1]-mstart[m];
+		for(i=mstart[m];i<mstart[m+1];i++)
+			q[nqs++]=users[i];
+	}
+	if(nqs!=NQUALIFY_SIZE) error("qualify.bin has %d entries, not %d\n",nqs,NQUALIFY_SIZE);
+	dump_bin("data/qualify.bin",q,NQUALIFY_SIZE*sizeof(int));
+
+	lg("Ratings 1-5:");
+	for(i=0;i<5;i++)
+		lg(" %.1f%%",100.*hist[i]/NENTRIES);
+	int umax=0;
+	for(u=0;u<NUSERS;u++)
+		if(nrate[u]>umax) umax=nrate[u];
+	lg("\nMost popular movie %d ratings, heaviest user %d\n",mcount[rank2movie[0]],umax);
+	lg("Wrote %d entries in %f sec\n",NENTRIES,wtime()-wt0);
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+########################################################################
+#  Netflix Prize Tools
+#  Copyright (C) 2009 Greg Bildson
+#  http://code.google.com/p/nprizeadditions/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+########################################################################
+*/
+/*   kbench.c
+     Times the vector kernels of basic.c on the sizes the models call them
+     with: vectors of NH hidden units and a user's ratings of NSOFT movies,
+     5 softmax units each.  Run by "make bench".
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "basic.h"
+
+#define NH	(100)
+#define NSOFT	(200)
+#define SECS	(0.5)	// per kernel
+
+double dv1[NSOFT*5], dv2[NSOFT*5];
+float fv1[NH], fv2[NH];
+double sink;
+
+// Calls of kernel k on n elements for about SECS seconds, in Melements/sec
+double run(int k, int n)
+{
+	long long calls=0;
+	double t0=wtime(),t;
+	int i;
+	do {
+		for(i=0;i<1000;i++) {
+			switch(k) {
+			// vsoftsig works in place, so it is timed with a copy of its input
+			case 0: memcpy(dv2,dv1,n*sizeof(double)); vsoftsig(dv2,n/5,5); break;
+			case 1: crng_uniform(dv2,n,1,calls,i,0); break;
+			case 2: sink+=ddvdot(dv1,dv2,n); break;
+			case 3: sink+=fdvdot(fv1,dv2,n); break;
+			case 4: sink+=ffvdot(fv1,fv2,n); break;
+			case 5: dvadd(dv2,dv1,n); break;
+			case 6: fvadd(fv2,fv1,n); break;
+			}
+		}
+		calls+=1000;
+		t=wtime()-t0;
+	} while(t<SECS);
+	return calls*n/t/1e6;
+}
+
+int main(int argc, char**argv)
+{
+	static char *names[]={"vsoftsig","crng_uniform","ddvdot","fdvdot","ffvdot","dvadd","fvadd"};
+	static int sizes[]={NSOFT*5,NH,NH,NH,NH,NH,NH};
+	int i,k;
+	lgopen(argc,argv);
+	for(i=0;i<NSOFT*5;i++)
+		dv1[i]=2.*drand48()-1.;
+	for(i=0;i<NH;i++)
+		fv1[i]=fv2[i]=dv2[i]=2.*drand48()-1.;
+	for(k=0;k<7;k++)
+		lg("%-14s %5d elements %10.1f M/sec\n",names[k],sizes[k],run(k,sizes[k]));
+	if(sink==1.2345) lg("\n");
+	return 0;
+}
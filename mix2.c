@@ -51,166 +51,261 @@ Math category.
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
 #include "basic.h"
 #include "netflix.h"
 #include "utest.h"
+#include "resid.h"
 
-#define NSCORES (5)
+/* Residuals are summed into XtX in chunks of MIXCHUNK entries stored column
+   by column, see mixchunk() */
+#define MIXCHUNK (128)
+/* The correlation tables are only printed for up to this many files */
+#define MIXPRINT (10)
 
-void openfiles(FILE *fp[],char *fnames[], int nscores)
+/* The residual files are mapped read-only, NENTRIES floats each, or
+   decoded if they are compressed (mapped[f] 0), see load_err() */
+void mapfiles(float *fs[], int mapped[], char *fnames[], int nscores)
 {
 	int f;
 	for(f=0;f<nscores;f++) {
 		lg("Mixing %s\n",fnames[f]);
-		if(NULL==(fp[f]=fopen(fnames[f],"rb")))
-			error("Cant open");
+		fs[f]=load_err(fnames[f],0,0,&mapped[f]);
 	}
 }
 
-void seekfiles(FILE *fp[], int nscores, int d)
+void unmapfiles(float *fs[], int mapped[], int nscores)
 {
-	if(!d) return;
 	int f;
 	for(f=0;f<nscores;f++)
-		if(fseek(fp[f],d*sizeof(float),SEEK_CUR))
-			error("Failed to seek\n");
+		if(mapped[f])
+			unmap_bin(fs[f],NENTRIES*sizeof(float));
+		else
+			free(fs[f]);
 }
 
-void readfiles(FILE *fp[], float *s, int nscores)
-{
-	int f;
-	for(f=0;f<nscores;f++)
-		if(1!=fread(&s[f],sizeof(float),1,fp[f])) {
-			lg("Error\n");
-			exit(1);
-		}
-}
+/* Each thread sums xtx over its range of users into its own matrix, and
+   computemix() adds them up in thread order */
+struct mixwork {
+	float **fs;
+	int *mapped;
+	int nscores;
+	double *xtx[MAXTHREADS];	/* [nscores+2][nscores+2], upper triangle */
+};
 
-void closefiles(FILE *fp[], int nscores)
+/* xtx[f][ff] += sum_i x[f][i]*x[ff][i] for ff>=f, where x holds n entries
+   of each of the ns2 columns.  Like a SYRK, this only forms the upper
+   triangle, and each x[f][i] is loaded once for four columns ff.  Every
+   entry is still summed over i in order. */
+void mixchunk(double *xtx, float *x, int ns2, int n)
 {
-	int f;
-	for(f=0;f<nscores;f++)
-		fclose(fp[f]);
+	int f,ff,i;
+	for(f=0;f<ns2;f++) {
+		float *xf=x+f*MIXCHUNK;
+		double *row=xtx+f*ns2;
+		for(ff=f;ff+4<=ns2;ff+=4) {
+			float *x0=x+ff*MIXCHUNK,*x1=x0+MIXCHUNK,*x2=x1+MIXCHUNK,*x3=x2+MIXCHUNK;
+			double s0=row[ff],s1=row[ff+1],s2=row[ff+2],s3=row[ff+3];
+			for(i=0;i<n;i++) {
+				float v=xf[i];
+				s0+=v*x0[i];
+				s1+=v*x1[i];
+				s2+=v*x2[i];
+				s3+=v*x3[i];
+			}
+			row[ff]=s0; row[ff+1]=s1; row[ff+2]=s2; row[ff+3]=s3;
+		}
+		for(;ff<ns2;ff++) {
+			float *x0=x+ff*MIXCHUNK;
+			double s0=row[ff];
+			for(i=0;i<n;i++)
+				s0+=xf[i]*x0[i];
+			row[ff]=s0;
+		}
+	}
 }
 
-computemix(char *fnames[], int nscores, double *xty)
+void mixpart(void *arg, int t, int nt)
 {
-#ifdef HOLDOUT
-	lg("With holdout\n");
-#endif
+	struct mixwork *w=arg;
+	int nscores=w->nscores;
 	int ns2=nscores+2;
-	int ns1=nscores+1;
-	FILE *fp[NSCORES];
-	openfiles(fp,fnames,nscores);
-
-	double xtx[NSCORES+2][NSCORES+2];
-	ZERO(xtx);
-	
+	double *xtx=w->xtx[t];
+	float *x=malloc(ns2*MIXCHUNK*sizeof(float));
+	if(!x) error("Cant allocate mix chunk\n");
+	int n=0;
+	int u0=(NUSERS*(long long)t)/nt;
+	int u1=(NUSERS*(long long)(t+1))/nt;
 	int u;
-	for(u=0; u<NUSERS; u++) {
-		PROGRESS(u,NUSERS);
+	for(u=u0; u<u1; u++) {
+		if(!t) PROGRESS(u,u1);
 		int base=useridx[u][0];
 #ifdef HOLDOUT
-		if(aopt) error("cant do holdout with -a");
 		int d0=UNTRAIN(u);
 		int d1=UNALL(u)-d0;
 #else
 		int d0=0;
 		int d1=UNTRAIN(u);
 #endif
-		seekfiles(fp,nscores, d0);
 		base+=d0;
 		int j;			
 		for(j=0;j<d1;j++) {
 			unsigned int dd=userent[base+j];
 			int r = (dd>>USER_LMOVIEMASK)&7;
-			float s[NSCORES+2];
-			readfiles(fp,s,nscores);
 			int f;
 			for(f=0;f<nscores;f++)		
-				s[f]=r-s[f];
-			s[nscores]=1.;
-			s[nscores+1]=r;
-
-			int ff;
-			for(f=0;f<ns2;f++) {
-				for(ff=0;ff<ns2;ff++)
-					xtx[f][ff] +=s[f]*s[ff];
+				x[f*MIXCHUNK+n]=r-w->fs[f][base+j];
+			x[nscores*MIXCHUNK+n]=1.;
+			x[(nscores+1)*MIXCHUNK+n]=r;
+			if(++n==MIXCHUNK) {
+				mixchunk(xtx,x,ns2,n);
+				n=0;
 			}
 		}
-		int d2=UNTOTAL(u)-(d1+d0);
-		seekfiles(fp,nscores, d2);
 	}
-	closefiles(fp,nscores);
-	int count=xtx[nscores][nscores];
+	mixchunk(xtx,x,ns2,n);
+	free(x);
+}
+
+#ifdef NOLAPACK
+/* Solves A x = b for a symmetric positive definite n x n matrix A (leading
+   dimension lda) by Cholesky decomposition, for builds without LAPACK.  Like
+   dposv_, A is overwritten by its factor and b by x.  Returns 0, or k if the
+   leading minor of order k is not positive definite. */
+int cholsolve(double *A, int n, int lda, double *b)
+{
+	int i,j,k;
+	for(j=0;j<n;j++) {
+		double d=A[j*lda+j];
+		for(k=0;k<j;k++)
+			d-=A[j*lda+k]*A[j*lda+k];
+		if(d<=0.) return j+1;
+		d=sqrt(d);
+		A[j*lda+j]=d;
+		for(i=j+1;i<n;i++) {
+			double s=A[i*lda+j];
+			for(k=0;k<j;k++)
+				s-=A[i*lda+k]*A[j*lda+k];
+			A[i*lda+j]=s/d;
+		}
+	}
+	/* L y = b, then L' x = y */
+	for(i=0;i<n;i++) {
+		double s=b[i];
+		for(k=0;k<i;k++)
+			s-=A[i*lda+k]*b[k];
+		b[i]=s/A[i*lda+i];
+	}
+	for(i=n-1;i>=0;i--) {
+		double s=b[i];
+		for(k=i+1;k<n;k++)
+			s-=A[k*lda+i]*b[k];
+		b[i]=s/A[i*lda+i];
+	}
+	return 0;
+}
+#endif
+
+computemix(char *fnames[], int nscores, double *xty)
+{
+#ifdef HOLDOUT
+	lg("With holdout\n");
+	if(aopt) error("cant do holdout with -a");
+#endif
+	int ns2=nscores+2;
+	int ns1=nscores+1;
+	int t,f,ff;
+	struct mixwork w;
+	w.nscores=nscores;
+	w.fs=malloc(nscores*sizeof(float *));
+	w.mapped=malloc(nscores*sizeof(int));
+	if(!w.fs || !w.mapped) error("Cant allocate mix work space\n");
+	for(t=0;t<nthreads;t++)
+		if(!(w.xtx[t]=calloc(ns2*ns2,sizeof(double)))) error("Cant allocate mix work space\n");
+	mapfiles(w.fs,w.mapped,fnames,nscores);
+	parallel(nthreads,mixpart,&w);
+	unmapfiles(w.fs,w.mapped,nscores);
+	free(w.fs);
+	free(w.mapped);
+
+#define XTX(f,ff) xtx[(f)*ns2+(ff)]
+	double *xtx=w.xtx[0];
+	for(t=1;t<nthreads;t++) {
+		dvadd(xtx,w.xtx[t],ns2*ns2);
+		free(w.xtx[t]);
+	}
+	for(f=0;f<ns2;f++)
+		for(ff=0;ff<f;ff++)
+			XTX(f,ff)=XTX(ff,f);
+	int count=XTX(nscores,nscores);
 	int j1,j2;
 	for(j1=0;j1<nscores;j1++)
-		lg("File %d RMSE %f\n",j1,sqrt((xtx[j1][j1]+xtx[ns1][ns1]-2*xtx[ns1][j1])/count));
-	double avgs[NSCORES+2],std[NSCORES+2];
+		lg("File %d RMSE %f\n",j1,sqrt((XTX(j1,j1)+XTX(ns1,ns1)-2*XTX(ns1,j1))/count));
+	double *avgs=malloc(ns2*sizeof(double)),*std=malloc(ns2*sizeof(double));
 	for(j1=0;j1<ns2;j1++) {
-		avgs[j1]=xtx[nscores][j1]/count;
-		std[j1]=sqrt(xtx[j1][j1]/count-avgs[j1]*avgs[j1]);
+		avgs[j1]=XTX(nscores,j1)/count;
+		std[j1]=sqrt(XTX(j1,j1)/count-avgs[j1]*avgs[j1]);
 	}
-	for(j1=0;j1<ns2;j1++)
-		lg("%f\t",avgs[j1]);
-	lg("\n");
-	for(j1=0;j1<ns2;j1++)
-		lg("%f\t",std[j1]);
-	lg("\n");
-	lg("-------------------------------------------------\n");
-	for(j1=0;j1<ns2;j1++) {
-		for(j2=0;j2<ns2;j2++) {
-			lg("%f\t",(xtx[j1][j2]/count-avgs[j1]*avgs[j2])/(std[j1]*std[j2]+1.e-6));
-		}
-		lg("\n");
-	}
-	lg("-------------------------------------------------\n");
-	double eavgs[NSCORES],estd[NSCORES];
+	double *eavgs=malloc(nscores*sizeof(double)),*estd=malloc(nscores*sizeof(double));
 	for(j1=0;j1<nscores;j1++) {
 		eavgs[j1]=avgs[ns1]-avgs[j1];
-		estd[j1]=sqrt((xtx[ns1][ns1]+ xtx[j1][j1]-2*xtx[j1][ns1])/count);
+		estd[j1]=sqrt((XTX(ns1,ns1)+ XTX(j1,j1)-2*XTX(j1,ns1))/count);
 	}
-	for(j1=0;j1<nscores;j1++)
-		lg("%f\t",eavgs[j1]);
-	lg("\n");
-	for(j1=0;j1<nscores;j1++)
-		lg("%f\t",estd[j1]);
-	lg("\n");
-	lg("-------------------------------------------------\n");
-	for(j1=0;j1<nscores;j1++) {
-		for(j2=0;j2<nscores;j2++) {
-			lg("%f\t",((xtx[j1][j2]+xtx[ns1][ns1]-xtx[ns1][j1]-xtx[ns1][j2])/count-eavgs[j1]*eavgs[j2])/(estd[j1]*estd[j2]+1.e-6));
+	if(nscores<=MIXPRINT) {
+		for(j1=0;j1<ns2;j1++)
+			lg("%f\t",avgs[j1]);
+		lg("\n");
+		for(j1=0;j1<ns2;j1++)
+			lg("%f\t",std[j1]);
+		lg("\n");
+		lg("-------------------------------------------------\n");
+		for(j1=0;j1<ns2;j1++) {
+			for(j2=0;j2<ns2;j2++) {
+				lg("%f\t",(XTX(j1,j2)/count-avgs[j1]*avgs[j2])/(std[j1]*std[j2]+1.e-6));
+			}
+			lg("\n");
 		}
+		lg("-------------------------------------------------\n");
+		for(j1=0;j1<nscores;j1++)
+			lg("%f\t",eavgs[j1]);
+		lg("\n");
+		for(j1=0;j1<nscores;j1++)
+			lg("%f\t",estd[j1]);
 		lg("\n");
+		lg("-------------------------------------------------\n");
+		for(j1=0;j1<nscores;j1++) {
+			for(j2=0;j2<nscores;j2++) {
+				lg("%f\t",((XTX(j1,j2)+XTX(ns1,ns1)-XTX(ns1,j1)-XTX(ns1,j2))/count-eavgs[j1]*eavgs[j2])/(estd[j1]*estd[j2]+1.e-6));
+			}
+			lg("\n");
+		}
 	}
+	free(avgs); free(std); free(eavgs); free(estd);
 
-
-	char TRANS='N';
 	char UFLO='U';
-	int M=ns1;
 	int N=ns1;
 	int NRHS=1;
-	double A[NSCORES+1][NSCORES+1];
-	int LDA=NSCORES+1;
-	double B[NSCORES+1];
-	int LDB=NSCORES+1;
-	double S[NSCORES+1];
-	double RCOND=0.00001; // singular values below this are treated as zero.
-	int RANK;
-	double WORK[1000];
-	int LWORK=1000;
+	double *A=malloc(ns1*ns1*sizeof(double));
+	int LDA=ns1;
+	double *B=malloc(ns1*sizeof(double));
+	int LDB=ns1;
 	int INFO;
+	if(!A || !B) error("Cant allocate the mix equations\n");
 
 	for(j1=0;j1<ns1;j1++) {
-		B[j1]=xtx[ns1][j1];
+		B[j1]=XTX(ns1,j1);
 		for(j2=0;j2<ns1;j2++)
-			A[j1][j2]=xtx[j1][j2];
+			A[j1*ns1+j2]=XTX(j1,j2);
 	}	
-	for(j1=0;j1<ns1;j1++) A[j1][j1]+=LAMBDA;
+	for(j1=0;j1<ns1;j1++) A[j1*ns1+j1]+=LAMBDA;
 	/*dgesv_(&N,&NRHS,A,&LDA,IPIV,B,&LDB,&INFO);*/
 	/*dgels_(&TRANS,&M,&N,&NRHS,A,&LDA,B,&LDB,WORK,&LWORK,&INFO);*/
 	/*dgelss_( &M, &N, &NRHS, A, &LDA, B, &LDB, S, &RCOND, &RANK, WORK, &LWORK, &INFO );*/
+#ifdef NOLAPACK
+	INFO=cholsolve(A,N,LDA,B);
+#else
 	dposv_(&UFLO,&N,&NRHS,A,&LDA,B,&LDB,&INFO);
+#endif
 	if(INFO) error("failed %d\n",INFO);
 		
 	for(j1=0;j1<=nscores;j1++)
@@ -220,15 +315,45 @@ computemix(char *fnames[], int nscores, double *xty)
 	for(j1=0;j1<=nscores;j1++) {
 		double sum=LAMBDA*B[j1];
 		for(j2=0;j2<=nscores;j2++)
-			sum+=xtx[j1][j2]*B[j2];
-		lg("%f\t%f\n",sum,xtx[nscores+1][j1]);
+			sum+=XTX(j1,j2)*B[j2];
+		lg("%f\t%f\n",sum,XTX(nscores+1,j1));
+	}
+#undef XTX
+	free(A); free(B); free(xtx);
+}
+
+/* err of the blend, each thread doing a range of entries */
+struct mixload {
+	float **fs;
+	int *mapped;
+	int nscores;
+	double *xty;
+};
+
+void mixapply(void *arg, int t, int nt)
+{
+	struct mixload *w=arg;
+	int nscores=w->nscores;
+	int i0=(NENTRIES*(long long)t)/nt;
+	int i1=(NENTRIES*(long long)(t+1))/nt;
+	int i;
+	for(i=i0; i<i1; i++) {
+		if(!t) PROGRESS(i,i1);
+		int r=(userent[i]>>USER_LMOVIEMASK)&7;
+		float stotal=0.;
+		int j;
+		for(j=0;j<nscores;j++)
+			stotal+=w->xty[j]*(r-w->fs[j][i]);
+		stotal+=w->xty[nscores];
+		err[i]=r-stotal;
 	}
 }
 
 loadmix(char *fnames[], int nscores, double *weights) {
-	if(nscores<2 || nscores>NSCORES) error("Bad number of files\n");
+	if(nscores<2) error("Bad number of files\n");
 	
-	double xty[NSCORES+1];
+	double *xty=malloc((nscores+1)*sizeof(double));
+	if(!xty) error("Cant allocate the mix weights\n");
 	if(weights) {
 		int j;
 		for(j=0;j<=nscores;j++)
@@ -241,20 +366,16 @@ loadmix(char *fnames[], int nscores, double *weights) {
 		lg("-lew %f ",xty[f]);
 	lg("\n");
 		
-	FILE *fp[NSCORES];
-	openfiles(fp,fnames,nscores);
-	int i;
-	for(i=0; i<NENTRIES; i++) {
-		PROGRESS(i,NENTRIES);
-		int r=(userent[i]>>USER_LMOVIEMASK)&7;
-		float s[NSCORES];
-		readfiles(fp,s,nscores);
-		float stotal=0.;
-		int j;
-		for(j=0;j<nscores;j++)
-			stotal+=xty[j]*(r-s[j]);
-		stotal+=xty[nscores];
-		err[i]=r-stotal;
-	}
-	closefiles(fp,nscores);
+	struct mixload w;
+	w.nscores=nscores;
+	w.xty=xty;
+	w.fs=malloc(nscores*sizeof(float *));
+	w.mapped=malloc(nscores*sizeof(int));
+	if(!w.fs || !w.mapped) error("Cant allocate mix work space\n");
+	mapfiles(w.fs,w.mapped,fnames,nscores);
+	parallel(nthreads,mixapply,&w);
+	unmapfiles(w.fs,w.mapped,nscores);
+	free(w.fs);
+	free(w.mapped);
+	free(xty);
 }
@@ -18,6 +18,20 @@
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 ########################################################################
 */
+#ifdef BENCH_USERS
+// Synthetic data written by gen (see gen.c) with BENCH_USERS users,
+// BENCH_MOVIES movies and BENCH_ENTRIES entries.  Probe and qualify keep
+// their share of the real entries and NMOVIES_QUALIFY its share of movies.
+#define NMOVIES (BENCH_MOVIES)
+#define NUSERS (BENCH_USERS)
+#define NENTRIES (BENCH_ENTRIES)
+#define NPROBE ((int)((long long)NENTRIES*1408395/103297638))
+#define NQUALIFY ((int)((long long)NENTRIES*2817131/103297638))
+#define NTRAIN (NENTRIES-NPROBE-NQUALIFY)
+#define NMOVIES_QUALIFY ((int)((long long)NMOVIES*17470/17770))
+#define NUSERS_QUALIFY (NUSERS)
+#define NQUALIFY_SIZE (NQUALIFY+2*NMOVIES_QUALIFY)
+#else
 #define NMOVIES (17770)
 #define NUSERS (480189)
 #define NPROBE (1408395)
@@ -28,6 +42,7 @@
 #define NQUALIFY_SIZE (2852071)		
 
 #define NENTRIES (103297638) // Total number of entries (training+probe+qualify)
+#endif
 #define MOVIE_LUSERMASK (19)
 #define MOVIE_USERMASK (0x7ffff) // (1<<MOVIE_LUSERMASK)-1
 #define MOVIE_LDAY (22)
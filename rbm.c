@@ -36,14 +36,13 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
 #include "basic.h"
 #include "netflix.h"
 #include "utest.h"
 #include "weight.h"
+#include "rbm.h"
 
-// Hard coded for 100 hidden variables.  This can adapt to 200 hidden.  See code at end.
-#define TOTAL_FEATURES  100  
-#define SOFTMAX         5
 #define epsilonw        0.001   // Learning rate for weights
 #define epsilonvb       0.008   // Learning rate for biases of visible units
 #define epsilonhb       0.0006  // Learning rate for biases of hidden units
@@ -51,40 +50,174 @@
 #define momentum        0.8  
 #define finalmomentum   0.9      
 
+int nhid = DEFAULT_HIDDEN;
+int hstride;
 
+// Parameters sized by nhid live in one arena allocated by score_setup().
 // vishid are the weights.
-double vishid[NMOVIES][SOFTMAX][TOTAL_FEATURES];
+real   *vishid;      // [NMOVIES][SOFTMAX][hstride]
 double visbiases[NMOVIES][SOFTMAX];
-double hidbiases[TOTAL_FEATURES];
-double CDpos[NMOVIES][SOFTMAX][TOTAL_FEATURES];
-double CDneg[NMOVIES][SOFTMAX][TOTAL_FEATURES];
-double CDinc[NMOVIES][SOFTMAX][TOTAL_FEATURES];
-
-double poshidprobs[TOTAL_FEATURES];
-char   poshidstates[TOTAL_FEATURES]; 
-char   curposhidstates[TOTAL_FEATURES]; 
-double poshidact[TOTAL_FEATURES];
-double neghidact[TOTAL_FEATURES];
-double neghidprobs[TOTAL_FEATURES];
-char   neghidstates[TOTAL_FEATURES]; 
-double hidbiasinc[TOTAL_FEATURES];
-
-double nvp2[NMOVIES][SOFTMAX];
-double negvisprobs[NMOVIES][SOFTMAX];
-char   negvissoftmax[NMOVIES]; 
-double posvisact[NMOVIES][SOFTMAX];
-double negvisact[NMOVIES][SOFTMAX];
+double *hidbiases;   // [hstride]
+real   *CDinc;       // [NMOVIES][SOFTMAX][hstride]
+double *hidbiasinc;  // [hstride]
 double visbiasinc[NMOVIES][SOFTMAX];
 
 unsigned int moviercount[SOFTMAX*NMOVIES];
-unsigned int moviecount[NMOVIES];
+
+// Users per minibatch
+#define BATCHSIZE 100
+
+// Per-thread training state.  The users of each minibatch are split between
+// the threads (-t).  Every thread has its own scratch space and accumulates its
+// own CD statistics, which are folded into work[0] before the weight update.
+struct rbmwork {
+    // Statistics for the movies touched by the current batch.  slot[m] is the
+    // row of movie m in CDpos/CDneg/posvisact/negvisact (-1 if untouched) and
+    // touched[] lists the movies by row, so only rows 0..ntouched-1 are ever
+    // cleared or visited by the weight update.  The arrays sized by nhid come
+    // from a per-thread arena, see work_setup().
+    real   *CDpos;       // [NMOVIES][SOFTMAX][hstride]
+    real   *CDneg;
+    double posvisact[NMOVIES][SOFTMAX];
+    double negvisact[NMOVIES][SOFTMAX];
+    int slot[NMOVIES];
+    int touched[NMOVIES];
+    int ntouched;
+    double *poshidact;   // [hstride]
+    double *neghidact;
+    unsigned int moviecount[NMOVIES];
+
+    real   *sumW;        // [hstride]
+    real   *poshidprobs;
+    double *neghidprobs;
+    uint64_t *posbits;   // [HWORDS] hidden states sampled in the positive
+    uint64_t *negbits;   // and negative phases, see HFOREACH
+    // Scratch for the current user, indexed by position j in the user's list
+    // of ratings rather than by movie, so nothing has to be cleared between
+    // users.  recon holds the logits and then the probabilities of the
+    // reconstruction from the sampled hidden states, recon2 the same from the
+    // hidden probabilities (for the rmse report) and negvissoftmax the
+    // sampled rating.
+    double recon[NMOVIES][SOFTMAX];
+    double recon2[NMOVIES][SOFTMAX];
+    char   negvissoftmax[NMOVIES];
+
+    // Entry counts for the rmse/prmse report, the error sums are in usqerr
+    int ntrain, n;
+
+    double *rnd;         // uniforms for the current sampling phase
+    int    tid;          // thread of parallel() using w, for PH_LAP()
+
+    // Scratch of the batched engine (-gemm) for the users of the thread's
+    // share of a batch, see train_users().  Their train and probe entries
+    // are numbered e user by user, bfirst[i] being the first of local user
+    // i.  bbymovie lists them grouped by movie: bmovies[] are the nbm movies
+    // in the order of their groups and bmstart[m] is where m's group starts.
+    // bmcount[] is zero between batches.  The arrays sized by entries grow
+    // with the batch.
+    int    bfirst[BATCHSIZE+1];
+    int    bmovies[NMOVIES];
+    int    bmstart[NMOVIES];
+    int    bmcount[NMOVIES];
+    int    nbm;
+    int    nbent;        // entries the arrays below have room for
+    int    *bbymovie;
+    unsigned int *bent;  // userent of entry e
+    int    *buser;       // local user of entry e
+    double (*brecon)[SOFTMAX];
+    double (*brecon2)[SOFTMAX];
+    char   *bvis;        // sampled rating of entry e
+    real   *bprobs;      // [BATCHSIZE][hstride] positive hidden probabilities
+    uint64_t *bpos;      // [BATCHSIZE][HWORDS] positive and negative
+    uint64_t *bneg;      // hidden states
+#ifdef RBM_BLAS
+    real   *bgather;     // [BATCHSIZE][hstride] and [BATCHSIZE][SOFTMAX]
+    real   *bgemm;       // for rgemm_()
+#endif
+};
+struct rbmwork *work[MAXTHREADS];
+
+// Squared errors of each user's train and probe ratings in the last epoch.
+// They are summed in user order, so the rmse that decides when training
+// stops does not depend on how the users were split between threads.
+double usqerr[NUSERS][2];
+
+// -gemm trains with train_users() instead of train_user()
+int gemm_engine = 0;
 
 
 #define E  (0.00002) // stop condition
-int score_argv(char **argv) {return 0;}
+
+// Key of the sampler's random streams, see crng_uniform()
+unsigned int rngseed = 1;
+
+// Checkpoint written with -sm and resumed from with -lm, see ckpt_save()
+char *ckpt_path = "data/rbm.ckpt";
+
+// Model file for rbmscore, written with -sm at the end of training
+char *model_path = "data/rbm.model";
+
+// -nh <n> sets the number of hidden units, -seed <n> the random seed,
+// -ckpt <fname> the checkpoint file and -model <fname> the model file.
+// -gemm selects the batched training engine.
+int score_argv(char **argv) {
+    if ( !strcmp(argv[0], "-gemm") ) {
+        gemm_engine = 1;
+        return 1;
+    }
+    if ( !strcmp(argv[0], "-nh") ) {
+        if ( !argv[1] ) error("-nh needs a number of hidden units\n");
+        nhid = atoi(argv[1]);
+        if ( nhid < 1 ) error("Bad number of hidden units %d (-nh)\n", nhid);
+        return 2;
+    }
+    if ( !strcmp(argv[0], "-seed") ) {
+        if ( !argv[1] ) error("-seed needs a number\n");
+        rngseed = strtoul(argv[1], NULL, 0);
+        return 2;
+    }
+    if ( !strcmp(argv[0], "-ckpt") ) {
+        if ( !argv[1] ) error("-ckpt needs a file name\n");
+        ckpt_path = argv[1];
+        return 2;
+    }
+    if ( !strcmp(argv[0], "-model") ) {
+        if ( !argv[1] ) error("-model needs a file name\n");
+        model_path = argv[1];
+        return 2;
+    }
+    return 0;
+}
+
+// Carve the parameters sized by nhid out of a, see arena_get()
+void model_carve(struct arena *a) {
+    vishid     = arena_get(a, (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real));
+    CDinc      = arena_get(a, (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real));
+    hidbiases  = arena_get(a, hstride*sizeof(double));
+    hidbiasinc = arena_get(a, hstride*sizeof(double));
+}
+
+// The parameters and momentum buffers stored in a checkpoint
+int ckpt_sections(struct cksec *s) {
+    int n = 0;
+    s[n].p = vishid;      s[n++].len = (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real);
+    s[n].p = CDinc;       s[n++].len = (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real);
+    s[n].p = visbiases;   s[n++].len = sizeof(visbiases);
+    s[n].p = visbiasinc;  s[n++].len = sizeof(visbiasinc);
+    s[n].p = hidbiases;   s[n++].len = hstride*sizeof(double);
+    s[n].p = hidbiasinc;  s[n++].len = hstride*sizeof(double);
+    return n;
+}
 
 void score_setup() {
     int i,u,m, j;
+    struct arena a = {0};
+
+    hstride = HPAD(nhid);
+    hk_setup();
+    model_carve(&a);
+    arena_alloc(&a);
+    model_carve(&a);
 
     for (m=0; m<NMOVIES; m++) {
         moviercount[m*SOFTMAX+0] = 0;
@@ -107,116 +240,679 @@ void score_setup() {
 }
 
 
+// Reconstruct the ratings of user u from the hidden probabilities and store
+// the residuals in err
+void record_user(struct rbmwork *w, int u) {
+    int h, j, i;
+
+    // Perform a training iteration on pure probabilities up to visible node reconstruction
+
+    int base0=useridx[u][0];
+    int d0=UNTRAIN(u);
+    int dall=UNALL(u);
+    double pc;
+    PH_START(&pc, w->tid);
+
+    // For all rated movies, accumulate contributions to hidden units
+    real *sumW=w->sumW;
+    HZERO(sumW);
+    for(j=0;j<d0;j++) {
+        int m=userent[base0+j]&USER_MOVIEMASK;
+
+        // 1. get one data point from data set.
+        // 2. use values of this data point to set state of visible neurons Si
+        int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
+
+        // for all hidden units h, sum_j(W[i][j] * v[0][j]))
+        hk.addrow(sumW, HMOV(vishid,m), r);
+    }
+
+    // Compute the hidden probabilities
+    for(h=0;h<nhid;h++) {
+
+        // 3. compute Sj for each hidden neuron based on formula above and states of visible neurons Si
+        // compute Q(h[0][i] = 1 | v[0]) # for binomial units, sigmoid(b[i] + sum_j(W[i][j] * v[0][j]))
+        w->poshidprobs[h]  = 1.0/(1.0 + exp(-sumW[h] - hidbiases[h]));
+    }
+    PH_LAP(&pc, w->tid, PH_UP);
+
+    // 5. on visible neurons compute Si using the Sj computed in step3. This is known as reconstruction
+    // for all visible units j:
+    int r;
+    int count = dall;
+    for(j=0;j<count;j++) {
+        int m=userent[base0+j]&USER_MOVIEMASK;
+        hk.dotrows(w->poshidprobs, HMOV(vishid,m), w->recon[j]);
+        for(r=0;r<SOFTMAX;r++) 
+            w->recon[j][r] += visbiases[m][r];
+    }
+
+    // compute P(v[1][j] = 1 | h[0]) # for binomial units, sigmoid(c[j] + sum_i(W[i][j] * h[0][i]))
+    // and normalize the probabilities, for all the rated movies in one call
+    vsoftsig(&w->recon[0][0], count, SOFTMAX);
+    PH_LAP(&pc, w->tid, PH_DOWN);
+
+    // Compute and save error residuals, recon[i] holds the probabilities of
+    // the i-th rating so there is nothing indexed by movie to clear
+    for(i=0; i<dall;i++) {
+        int r=(userent[base0+i]>>USER_LMOVIEMASK)&7;
+        double *p = w->recon[i];
+        double expectedV = p[1] + 2.0 * p[2] + 3.0 * p[3] + 4.0 * p[4];
+        double vdelta = (((double)r)-expectedV);
+        err[base0+i] = vdelta;
+    }
+    PH_LAP(&pc, w->tid, PH_RMSE);
+}
+
+void record_block(void *arg, int t, int nt) {
+    int *range = arg;
+    int n = range[1] - range[0];
+    int u;
+    for(u=range[0]+(n*t)/nt; u<range[0]+(n*(t+1))/nt; u++)
+        record_user(work[t], u);
+}
+
+// Users per block handed to err_stream()
+#define RECBLOCK 1000
+
+// The users are independent here, so each block is split between the
+// threads like a training batch, every thread using its own scratch space
 void recordErrors() {
-    int u,h,f, j, i;
-    for(u=0;u<NUSERS;u++) {
+    int range[2];
+    double pc;
+    for(range[0]=0;range[0]<NUSERS;range[0]+=RECBLOCK) {
+        range[1] = range[0]+RECBLOCK < NUSERS ? range[0]+RECBLOCK : NUSERS;
+        parallel(nthreads, record_block, range);
+        PH_START(&pc, 0);
+        err_stream(range[0], range[1]);
+        PH_LAP(&pc, 0, PH_IO);
+    }
+}
 
-        // Zero out the probability accumulator
-        ZERO(negvisprobs);
+int score_train(int loop) {
+    if (loop == 0)
+        return doAllFeatures();
+    
+    return 1;
+}
 
-        //
-        // Perform a training iteration on pure probabilities up to visible node reconstruction
+double randn() {
+    return (rand()/(double)(RAND_MAX));
+}
 
-        int base0=useridx[u][0];
-        int d0=UNTRAIN(u);
-        int dall=UNALL(u);
+// The uniforms used by the sampler for user u in epoch are a function of
+// (rngseed, epoch, u, phase) only, so a run gives the same result on any
+// number of threads.  Phase 0 samples the positive hidden states, and CD
+// step stepT samples the visible units in phase 2*stepT+1 and the hidden
+// units in phase 2*stepT+2.
+#define urands(w,n,epoch,u,phase) crng_uniform((w)->rnd, (n), rngseed, (epoch), (u), (phase))
+
+// Give movie m the next free row of the batch statistics in w
+static int touch(struct rbmwork *w, int m) {
+    w->slot[m] = w->ntouched;
+    w->touched[w->ntouched] = m;
+    return w->ntouched++;
+}
 
-        // For all rated movies, accumulate contributions to hidden units
-        double sumW[TOTAL_FEATURES];
-        ZERO(sumW);
-        for(j=0;j<d0;j++) {
-            int m=userent[base0+j]&USER_MOVIEMASK;
+// Perform steps 1 to 8 for a single user, accumulating the contrastive
+// divergence statistics into w and the error sums into usqerr[u]
+void train_user(struct rbmwork *w, int u, int tSteps, int epoch) {
+    int i, j, h;
+    double pc;
+    PH_START(&pc, w->tid);
+
+    //* perform steps 1 to 8
+    int base0=useridx[u][0];
+    int d0=UNTRAIN(u);
+    int dall=UNALL(u);
+
+    // For all rated movies, accumulate contributions to hidden units
+    real *sumW=w->sumW;
+    HZERO(sumW);
+    for(j=0;j<d0;j++) {
+        int m=userent[base0+j]&USER_MOVIEMASK;
+        if ( w->slot[m] < 0 ) touch(w, m);
+        w->moviecount[m]++;
+
+        // 1. get one data point from data set.
+        // 2. use values of this data point to set state of visible neurons Si
+        int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
+
+        // Add to the bias contribution for set visible units
+        w->posvisact[w->slot[m]][r] += 1.0;
+ 
+        // for all hidden units h, sum_j(W[i][j] * v[0][j]))
+        hk.addrow(sumW, HMOV(vishid,m), r);
+    }
 
-            // 1. get one data point from data set.
-            // 2. use values of this data point to set state of visible neurons Si
-            int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
+    // Sample the hidden units state after computing probabilities
+    memset(w->posbits, 0, HWORDS*sizeof(uint64_t));
+    urands(w, nhid, epoch, u, 0);
+    for(h=0;h<nhid;h++) {
 
-            // for all hidden units h:
-            for(h=0;h<TOTAL_FEATURES;h++) {
-                // sum_j(W[i][j] * v[0][j]))
-                sumW[h]  += vishid[m][r][h];
-            }
-        }
+        // 3. compute Sj for each hidden neuron based on formula above and states of visible neurons Si
+        // poshidprobs[h] = 1./(1 + exp(-V*vishid - hidbiases);
+        // compute Q(h[0][i] = 1 | v[0]) # for binomial units, sigmoid(b[i] + sum_j(W[i][j] * v[0][j]))
+        w->poshidprobs[h]  = 1.0/(1.0 + exp(-sumW[h] - hidbiases[h]));
 
-        // Compute the hidden probabilities
-        for(h=0;h<TOTAL_FEATURES;h++) {
+        // sample h[0][i] from Q(h[0][i] = 1 | v[0])
+        int on = w->poshidprobs[h] > w->rnd[h];
+        HSETBIT(w->posbits, h, on);
+        w->poshidact[h] += on;
+    }
+    PH_LAP(&pc, w->tid, PH_UP);
 
-            // 3. compute Sj for each hidden neuron based on formula above and states of visible neurons Si
-            // compute Q(h[0][i] = 1 | v[0]) # for binomial units, sigmoid(b[i] + sum_j(W[i][j] * v[0][j]))
-            poshidprobs[h]  = 1.0/(1.0 + exp(-sumW[h] - hidbiases[h]));
-        }
+    // The hidden units on for the reconstruction, starting with the positive phase
+    uint64_t *curbits = w->posbits;
 
+    // Make T Contrastive Divergence steps
+    int stepT = 0;
+    do {
+        // Determine if this is the last pass through this loop
+        int finalTStep = (stepT+1 >= tSteps);
+        
         // 5. on visible neurons compute Si using the Sj computed in step3. This is known as reconstruction
         // for all visible units j:
         int r;
-        int count = dall;
+        int count = d0;
+        count += useridx[u][2];  // too compute probe errors
         for(j=0;j<count;j++) {
             int m=userent[base0+j]&USER_MOVIEMASK;
-            for(h=0;h<TOTAL_FEATURES;h++) {
-                for(r=0;r<SOFTMAX;r++) 
-                    negvisprobs[m][r]  += poshidprobs[h] * vishid[m][r][h];
+            // Accumulate Weight values for sampled hidden states == 1
+            hsumrows(HMOV(vishid,m), curbits, w->recon[j]);
+
+            // Compute more accurate probabilites for RMSE reporting
+            if ( stepT == 0 )
+                hk.dotrows(w->poshidprobs, HMOV(vishid,m), w->recon2[j]);
+
+            for(r=0;r<SOFTMAX;r++) {
+                w->recon[j][r] += visbiases[m][r];
+                if ( stepT == 0 )
+                    w->recon2[j][r] += visbiases[m][r];
             }
+        }
+
+        // compute P(v[1][j] = 1 | h[0]) # for binomial units, sigmoid(c[j] + sum_i(W[i][j] * h[0][i]))
+        // and normalize the probabilities, for all the rated movies in one call
+        vsoftsig(&w->recon[0][0], count, SOFTMAX);
+        if ( stepT == 0 )
+            vsoftsig(&w->recon2[0][0], count, SOFTMAX);
+        PH_LAP(&pc, w->tid, PH_DOWN);
+
+        urands(w, count, epoch, u, 2*stepT+1);
+        for(j=0;j<count;j++) {
+            int m=userent[base0+j]&USER_MOVIEMASK;
+            double *negvisprobs = w->recon[j];
+
+            // sample v[1][j] from P(v[1][j] = 1 | h[0])
+            double randval = w->rnd[j];
+            if ( (randval -= negvisprobs[0]) <= 0.0 )
+                w->negvissoftmax[j] = 0;
+            else if ( (randval -= negvisprobs[1]) <= 0.0 )
+                w->negvissoftmax[j] = 1;
+            else if ( (randval -= negvisprobs[2]) <= 0.0 )
+                w->negvissoftmax[j] = 2;
+            else if ( (randval -= negvisprobs[3]) <= 0.0 )
+                w->negvissoftmax[j] = 3;
+            else //if ( (randval -= negvisprobs[4]) <= 0.0 )
+                w->negvissoftmax[j] = 4;
+
+            // if in training data then train on it
+            if ( j < d0 && finalTStep )  
+                w->negvisact[w->slot[m]][w->negvissoftmax[j]] += 1.0;
+        }
+        PH_LAP(&pc, w->tid, PH_SAMPLE);
+
+
+        // 6. compute state of hidden neurons Sj again using Si from 5 step.
+        // For all rated movies accumulate contributions to hidden units from sampled visible units
+        HZERO(sumW);
+        for(j=0;j<d0;j++) {
+            int m=userent[base0+j]&USER_MOVIEMASK;
+ 
+            // for all hidden units h:
+            hk.addrow(sumW, HMOV(vishid,m), w->negvissoftmax[j]);
+        }
+        // for all hidden units h:
+        memset(w->negbits, 0, HWORDS*sizeof(uint64_t));
+        urands(w, nhid, epoch, u, 2*stepT+2);
+        for(h=0;h<nhid;h++) {
+            // compute Q(h[1][i] = 1 | v[1]) # for binomial units, sigmoid(b[i] + sum_j(W[i][j] * v[1][j]))
+            w->neghidprobs[h]  = 1./(1 + exp(-sumW[h] - hidbiases[h]));
+
+            // Sample the hidden units state again.
+            int on = w->neghidprobs[h] > w->rnd[h];
+            HSETBIT(w->negbits, h, on);
+            if ( finalTStep )
+                w->neghidact[h] += on;
+        }
+        PH_LAP(&pc, w->tid, PH_UP);
+
+        // Compute error rmse and prmse before we start iterating on T
+        if ( stepT == 0 ) {
+            usqerr[u][0] = usqerr[u][1] = 0.0;
 
-            // compute P(v[1][j] = 1 | h[0]) # for binomial units, sigmoid(c[j] + sum_i(W[i][j] * h[0][i]))
-            negvisprobs[m][0]  = 1./(1 + exp(-negvisprobs[m][0] - visbiases[m][0]));
-            negvisprobs[m][1]  = 1./(1 + exp(-negvisprobs[m][1] - visbiases[m][1]));
-            negvisprobs[m][2]  = 1./(1 + exp(-negvisprobs[m][2] - visbiases[m][2]));
-            negvisprobs[m][3]  = 1./(1 + exp(-negvisprobs[m][3] - visbiases[m][3]));
-            negvisprobs[m][4]  = 1./(1 + exp(-negvisprobs[m][4] - visbiases[m][4]));
-
-            // Normalize probabilities
-            double tsum  = 
-              negvisprobs[m][0] +
-              negvisprobs[m][1] +
-              negvisprobs[m][2] +
-              negvisprobs[m][3] +
-              negvisprobs[m][4];
-            if ( tsum != 0 ) {
-                negvisprobs[m][0]  /= tsum;
-                negvisprobs[m][1]  /= tsum;
-                negvisprobs[m][2]  /= tsum;
-                negvisprobs[m][3]  /= tsum;
-                negvisprobs[m][4]  /= tsum;
+            // Compute rmse on training data
+            for(j=0;j<d0;j++) {
+                int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
+                double *nvp2 = w->recon2[j];
+ 
+                //# Compute some error function like sum of squared difference between Si in 1) and Si in 5)
+                double expectedV = nvp2[1] + 2.0 * nvp2[2] + 3.0 * nvp2[3] + 4.0 * nvp2[4];
+                double vdelta = (((double)r)-expectedV);
+                usqerr[u][0] += (vdelta * vdelta);
+            }
+            w->ntrain+=d0;
+
+            // Sum up probe rmse, the probe ratings follow the useridx[u][1]
+            // training ratings
+            int base=useridx[u][0];
+            for(i=1;i<2;i++) base+=useridx[u][i];
+            int d=useridx[u][2];
+            for(i=0; i<d;i++) {
+                int r=(userent[base+i]>>USER_LMOVIEMASK)&7;
+                double *nvp2 = w->recon2[useridx[u][1]+i];
+                //# Compute some error function like sum of squared difference between Si in 1) and Si in 5)
+                double expectedV = nvp2[1] + 2.0 * nvp2[2] + 3.0 * nvp2[3] + 4.0 * nvp2[4];
+                double vdelta = (((double)r)-expectedV);
+                usqerr[u][1]+=vdelta*vdelta;
             }
+            w->n+=d;
+            PH_LAP(&pc, w->tid, PH_RMSE);
         }
 
-        // Compute and save error residuals
-        for(i=0; i<dall;i++) {
-            int m=userent[base0+i]&USER_MOVIEMASK;
-            int r=(userent[base0+i]>>USER_LMOVIEMASK)&7;
-            double expectedV = negvisprobs[m][1] + 2.0 * negvisprobs[m][2] + 3.0 * negvisprobs[m][3] + 4.0 * negvisprobs[m][4];
-            double vdelta = (((double)r)-expectedV);
-            err[base0+i] = vdelta;
+        // If looping again, load the curposvisstates
+        if ( !finalTStep ) {
+            curbits = w->negbits;
         }
+
+      // 8. repeating multiple times steps 5,6 and 7 compute (Si.Sj)n. Where n is small number and can 
+      //    increase with learning steps to achieve better accuracy.
+
+    } while ( ++stepT < tSteps );
+
+    // Accumulate contrastive divergence contributions for (Si.Sj)0 and (Si.Sj)T
+    for(j=0;j<d0;j++) {
+        int m=userent[base0+j]&USER_MOVIEMASK;
+        int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
+        int k=w->slot[m];
+ 
+        // 4. now Si and Sj values can be used to compute (Si.Sj)0  here () means just values not average
+        //* accumulate CDpos = CDpos + (Si.Sj)0, only the units that are on contribute
+        real *cdp = HMOV(w->CDpos,k);
+        HFOREACH(w->posbits,h)
+            cdp[HIDX(r,h)] += 1.0;
+
+        // 7. now use Si and Sj to compute (Si.Sj)1 (fig.3)
+        real *cdn = HMOV(w->CDneg,k);
+        int rn = w->negvissoftmax[j];
+        HFOREACH(w->negbits,h)
+            cdn[HIDX(rn,h)] += 1.0;
     }
+    PH_LAP(&pc, w->tid, PH_CD);
 }
 
-int score_train(int loop) {
-    if (loop == 0)
-        return doAllFeatures();
-    
-    return 1;
+#ifdef RBM_BLAS
+// Build with -DRBM_BLAS (and link -lblas) to have the batched engine hand the
+// products of the hidden probabilities and the weights to BLAS.  They are
+// then summed in BLAS's order, so the model differs from the in-tree
+// kernels' in the last bits.
+#ifdef RBM_TILED
+#error RBM_BLAS needs the row layout
+#endif
+#ifdef RBM_FLOAT
+#define rgemm_ sgemm_
+#else
+#define rgemm_ dgemm_
+#endif
+#endif
+
+// Make room for ne entries in the batched engine's scratch
+void batch_grow(struct rbmwork *w, int ne) {
+    if ( ne <= w->nbent ) return;
+    w->nbent = ne + ne/2;
+    w->bbymovie = realloc(w->bbymovie, w->nbent*sizeof(int));
+    w->bent     = realloc(w->bent, w->nbent*sizeof(unsigned int));
+    w->buser    = realloc(w->buser, w->nbent*sizeof(int));
+    w->brecon   = realloc(w->brecon, w->nbent*sizeof(*w->brecon));
+    w->brecon2  = realloc(w->brecon2, w->nbent*sizeof(*w->brecon2));
+    w->bvis     = realloc(w->bvis, w->nbent);
+    if ( !w->bbymovie || !w->bent || !w->buser || !w->brecon || !w->brecon2 || !w->bvis )
+        error("Cant allocate batch space for %d entries\n", ne);
 }
 
-double randn() {
-    return (rand()/(double)(RAND_MAX));
+// The entries of the q'th movie group of a batch of ne entries, and their number
+int *batch_group(struct rbmwork *w, int q, int ne, int *k) {
+    int m = w->bmovies[q];
+    int end = q+1 < w->nbm ? w->bmstart[w->bmovies[q+1]] : ne;
+    *k = end - w->bmstart[m];
+    return w->bbymovie + w->bmstart[m];
+}
+
+// Step 5 for the entries of the q'th movie group: the reconstruction from
+// their users' hidden states cur and, if probs, from the hidden
+// probabilities.  The movie's weights are read once for all the users who
+// rated it, the probabilities go through dotrows4 four users at a time.
+void batch_down(struct rbmwork *w, int q, int ne, uint64_t *cur, int probs) {
+    int m = w->bmovies[q];
+    real *wm = HMOV(vishid,m);
+    int i, r, k;
+    int *e = batch_group(w, q, ne, &k);
+
+    for(i=0;i<k;i++)
+        hsumrows(wm, cur + (size_t)w->buser[e[i]]*HWORDS, w->brecon[e[i]]);
+    if ( probs ) {
+#ifdef RBM_BLAS
+        char tr='T', nt='N';
+        int nr=SOFTMAX;
+        real one=1., zero=0.;
+        for(i=0;i<k;i++)
+            memcpy(w->bgather + (size_t)i*hstride, w->bprobs + (size_t)w->buser[e[i]]*hstride, hstride*sizeof(real));
+        // bgemm[i][r] = (row r of wm).bgather[i]
+        rgemm_(&tr,&nt,&nr,&k,&nhid,&one,wm,&hstride,w->bgather,&hstride,&zero,w->bgemm,&nr);
+        for(i=0;i<k;i++)
+            for(r=0;r<SOFTMAX;r++)
+                w->brecon2[e[i]][r] = w->bgemm[i*SOFTMAX+r];
+#else
+        for(i=0;i+4<=k;i+=4) {
+            real *a[4];
+            double *out[4];
+            int t;
+            for(t=0;t<4;t++) {
+                a[t] = w->bprobs + (size_t)w->buser[e[i+t]]*hstride;
+                out[t] = w->brecon2[e[i+t]];
+            }
+            hk.dotrows4(a, wm, out);
+        }
+        for(;i<k;i++)
+            hk.dotrows(w->bprobs + (size_t)w->buser[e[i]]*hstride, wm, w->brecon2[e[i]]);
+#endif
+    }
+    for(i=0;i<k;i++)
+        for(r=0;r<SOFTMAX;r++) {
+            w->brecon[e[i]][r] += visbiases[m][r];
+            if ( probs )
+                w->brecon2[e[i]][r] += visbiases[m][r];
+        }
+}
+
+// train_user() for the users u0..u1-1 together, each step done for all of
+// them before the next.  The up passes go user by user (the batch's sparse
+// visible matrix times the weights), the down passes and the CD statistics
+// movie by movie (its transpose times the hidden states), so every movie's
+// weights and statistics are visited once per step for all the users who
+// rated it.  The sums are formed in the same order and with the same
+// uniforms as train_user(), so both engines train the same model.
+void train_users(struct rbmwork *w, int u0, int u1, int tSteps, int epoch) {
+    int nu = u1 - u0;
+    int i, j, e, h, q, ne;
+    double pc;
+    PH_START(&pc, w->tid);
+
+    // Number the entries and group them by movie
+    for(i=0,ne=0;i<nu;i++) {
+        w->bfirst[i] = ne;
+        ne += UNTRAIN(u0+i) + useridx[u0+i][2];
+    }
+    w->bfirst[nu] = ne;
+    batch_grow(w, ne);
+    w->nbm = 0;
+    for(i=0;i<nu;i++)
+        for(e=w->bfirst[i];e<w->bfirst[i+1];e++) {
+            unsigned int x = userent[useridx[u0+i][0]+e-w->bfirst[i]];
+            int m = x&USER_MOVIEMASK;
+            if ( w->bmcount[m]++ == 0 ) w->bmovies[w->nbm++] = m;
+            w->bent[e] = x;
+            w->buser[e] = i;
+        }
+    for(q=0,e=0;q<w->nbm;q++) {
+        int m = w->bmovies[q];
+        w->bmstart[m] = e;
+        e += w->bmcount[m];
+    }
+    for(e=0;e<ne;e++) {
+        int m = w->bent[e]&USER_MOVIEMASK;
+        w->bbymovie[w->bmstart[m] + --w->bmcount[m]] = e;
+    }
+
+    // Steps 1 to 3, user by user
+    for(i=0;i<nu;i++) {
+        int u = u0+i;
+        int d0 = UNTRAIN(u);
+        unsigned int *ent = w->bent + w->bfirst[i];
+        real *sumW = w->sumW;
+        real *probs = w->bprobs + (size_t)i*hstride;
+        uint64_t *bits = w->bpos + (size_t)i*HWORDS;
+
+        HZERO(sumW);
+        for(j=0;j<d0;j++) {
+            int m=ent[j]&USER_MOVIEMASK;
+            int r=(ent[j]>>USER_LMOVIEMASK)&7;
+            if ( w->slot[m] < 0 ) touch(w, m);
+            w->moviecount[m]++;
+            w->posvisact[w->slot[m]][r] += 1.0;
+            hk.addrow(sumW, HMOV(vishid,m), r);
+        }
+        memset(bits, 0, HWORDS*sizeof(uint64_t));
+        urands(w, nhid, epoch, u, 0);
+        for(h=0;h<nhid;h++) {
+            probs[h] = 1.0/(1.0 + exp(-sumW[h] - hidbiases[h]));
+            int on = probs[h] > w->rnd[h];
+            HSETBIT(bits, h, on);
+            w->poshidact[h] += on;
+        }
+    }
+    PH_LAP(&pc, w->tid, PH_UP);
+
+    // T Contrastive Divergence steps
+    uint64_t *cur = w->bpos;
+    int stepT = 0;
+    do {
+        int finalTStep = (stepT+1 >= tSteps);
+
+        // 5. Reconstruct the visible units, movie by movie
+        for(q=0;q<w->nbm;q++)
+            batch_down(w, q, ne, cur, stepT == 0);
+        vsoftsig(&w->brecon[0][0], ne, SOFTMAX);
+        if ( stepT == 0 )
+            vsoftsig(&w->brecon2[0][0], ne, SOFTMAX);
+        PH_LAP(&pc, w->tid, PH_DOWN);
+
+        // Sample them and 6. compute the hidden units again, user by user
+        for(i=0;i<nu;i++) {
+            int u = u0+i;
+            int d0 = UNTRAIN(u);
+            int e0 = w->bfirst[i];
+            int count = w->bfirst[i+1] - e0;
+            unsigned int *ent = w->bent + e0;
+            real *sumW = w->sumW;
+            uint64_t *bits = w->bneg + (size_t)i*HWORDS;
+
+            urands(w, count, epoch, u, 2*stepT+1);
+            for(j=0;j<count;j++) {
+                double *p = w->brecon[e0+j];
+                double randval = w->rnd[j];
+                int v;
+                if ( (randval -= p[0]) <= 0.0 )
+                    v = 0;
+                else if ( (randval -= p[1]) <= 0.0 )
+                    v = 1;
+                else if ( (randval -= p[2]) <= 0.0 )
+                    v = 2;
+                else if ( (randval -= p[3]) <= 0.0 )
+                    v = 3;
+                else
+                    v = 4;
+                w->bvis[e0+j] = v;
+                if ( j < d0 && finalTStep )
+                    w->negvisact[w->slot[ent[j]&USER_MOVIEMASK]][v] += 1.0;
+            }
+            PH_LAP(&pc, w->tid, PH_SAMPLE);
+
+            HZERO(sumW);
+            for(j=0;j<d0;j++)
+                hk.addrow(sumW, HMOV(vishid,ent[j]&USER_MOVIEMASK), w->bvis[e0+j]);
+            memset(bits, 0, HWORDS*sizeof(uint64_t));
+            urands(w, nhid, epoch, u, 2*stepT+2);
+            for(h=0;h<nhid;h++) {
+                w->neghidprobs[h]  = 1./(1 + exp(-sumW[h] - hidbiases[h]));
+                int on = w->neghidprobs[h] > w->rnd[h];
+                HSETBIT(bits, h, on);
+                if ( finalTStep )
+                    w->neghidact[h] += on;
+            }
+            PH_LAP(&pc, w->tid, PH_UP);
+
+            // Error sums as in train_user()
+            if ( stepT == 0 ) {
+                usqerr[u][0] = usqerr[u][1] = 0.0;
+                for(j=0;j<d0;j++) {
+                    int r=(ent[j]>>USER_LMOVIEMASK)&7;
+                    double *nvp2 = w->brecon2[e0+j];
+                    double vdelta = r - (nvp2[1] + 2.0 * nvp2[2] + 3.0 * nvp2[3] + 4.0 * nvp2[4]);
+                    usqerr[u][0] += vdelta * vdelta;
+                }
+                w->ntrain += d0;
+                for(j=useridx[u][1];j<useridx[u][1]+useridx[u][2];j++) {
+                    int r=(ent[j]>>USER_LMOVIEMASK)&7;
+                    double *nvp2 = w->brecon2[e0+j];
+                    double vdelta = r - (nvp2[1] + 2.0 * nvp2[2] + 3.0 * nvp2[3] + 4.0 * nvp2[4]);
+                    usqerr[u][1] += vdelta * vdelta;
+                }
+                w->n += useridx[u][2];
+                PH_LAP(&pc, w->tid, PH_RMSE);
+            }
+        }
+        cur = w->bneg;
+    } while ( ++stepT < tSteps );
+
+    // 4. and 7. Accumulate the CD statistics of the training entries, movie
+    // by movie
+    for(q=0;q<w->nbm;q++) {
+        int k, slot = w->slot[w->bmovies[q]];
+        int *eg = batch_group(w, q, ne, &k);
+        if ( slot < 0 ) continue;
+        real *cdp = HMOV(w->CDpos,slot);
+        real *cdn = HMOV(w->CDneg,slot);
+        for(j=0;j<k;j++) {
+            e = eg[j];
+            i = w->buser[e];
+            if ( e - w->bfirst[i] >= UNTRAIN(u0+i) ) continue;
+            int r = (w->bent[e]>>USER_LMOVIEMASK)&7;
+            HFOREACH(w->bpos + (size_t)i*HWORDS, h)
+                cdp[HIDX(r,h)] += 1.0;
+            int rn = w->bvis[e];
+            HFOREACH(w->bneg + (size_t)i*HWORDS, h)
+                cdn[HIDX(rn,h)] += 1.0;
+        }
+    }
+    PH_LAP(&pc, w->tid, PH_CD);
+}
+
+struct batch {
+    int u0, u1;
+    int tSteps;
+    int epoch;
+};
+
+void train_batch(void *arg, int t, int nt) {
+    struct batch *b = arg;
+    int n = b->u1 - b->u0;
+    int u;
+    if ( gemm_engine )
+        train_users(work[t], b->u0+(n*t)/nt, b->u0+(n*(t+1))/nt, b->tSteps, b->epoch);
+    else
+        for(u=b->u0+(n*t)/nt; u<b->u0+(n*(t+1))/nt; u++)
+            train_user(work[t], u, b->tSteps, b->epoch);
+}
+
+// Fold the statistics of threads 1..nt-1 into work[0].  The touched lists
+// have already been merged into work[0]'s; each thread takes a slice of it
+// and clears the rows it has folded.
+void reduce_batch(void *arg, int t, int nt) {
+    struct rbmwork *w0 = work[0];
+    int i0 = (w0->ntouched*t)/nt;
+    int i1 = (w0->ntouched*(t+1))/nt;
+    int i, k;
+    for(i=i0;i<i1;i++) {
+        int m = w0->touched[i];
+        for(k=1;k<nt;k++) {
+            struct rbmwork *w = work[k];
+            int ks = w->slot[m];
+            if ( ks < 0 ) continue;
+            rvadd(HMOV(w0->CDpos,i), HMOV(w->CDpos,ks), SOFTMAX*hstride);
+            rvadd(HMOV(w0->CDneg,i), HMOV(w->CDneg,ks), SOFTMAX*hstride);
+            dvadd(w0->posvisact[i], w->posvisact[ks], SOFTMAX);
+            dvadd(w0->negvisact[i], w->negvisact[ks], SOFTMAX);
+            memset(HMOV(w->CDpos,ks), 0, SOFTMAX*hstride*sizeof(real));
+            memset(HMOV(w->CDneg,ks), 0, SOFTMAX*hstride*sizeof(real));
+            ZERO(w->posvisact[ks]);
+            ZERO(w->negvisact[ks]);
+            w0->moviecount[m] += w->moviecount[m];
+            w->moviecount[m] = 0;
+            w->slot[m] = -1;
+        }
+    }
+}
+
+// Carve the arrays of w sized by nhid out of a, see arena_get()
+void work_carve(struct rbmwork *w, struct arena *a) {
+    w->CDpos           = arena_get(a, (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real));
+    w->CDneg           = arena_get(a, (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real));
+    w->poshidact       = arena_get(a, hstride*sizeof(double));
+    w->neghidact       = arena_get(a, hstride*sizeof(double));
+    w->sumW            = arena_get(a, hstride*sizeof(real));
+    w->poshidprobs     = arena_get(a, hstride*sizeof(real));
+    w->neghidprobs     = arena_get(a, hstride*sizeof(double));
+    w->posbits         = arena_get(a, HWORDS*sizeof(uint64_t));
+    w->negbits         = arena_get(a, HWORDS*sizeof(uint64_t));
+    w->rnd             = arena_get(a, (nhid > NMOVIES ? nhid : NMOVIES)*sizeof(double));
+    if ( gemm_engine ) {
+        w->bprobs      = arena_get(a, (size_t)BATCHSIZE*hstride*sizeof(real));
+        w->bpos        = arena_get(a, (size_t)BATCHSIZE*HWORDS*sizeof(uint64_t));
+        w->bneg        = arena_get(a, (size_t)BATCHSIZE*HWORDS*sizeof(uint64_t));
+#ifdef RBM_BLAS
+        w->bgather     = arena_get(a, (size_t)BATCHSIZE*hstride*sizeof(real));
+        w->bgemm       = arena_get(a, (size_t)BATCHSIZE*SOFTMAX*sizeof(real));
+#endif
+    }
+}
+
+void work_setup() {
+    int t, m;
+    for(t=0;t<nthreads;t++) {
+        struct arena a = {0};
+        if ( work[t] ) continue;
+        work[t] = calloc(1, sizeof(struct rbmwork));
+        if ( !work[t] ) error("Cant allocate thread %d work space\n", t);
+        work[t]->tid = t;
+        work_carve(work[t], &a);
+        arena_alloc(&a);
+        work_carve(work[t], &a);
+        for(m=0;m<NMOVIES;m++)
+            work[t]->slot[m] = -1;
+    }
 }
 
 int doAllFeatures() {
     /* Initial weights */
-    int i, j, h;
+    int i, j, h, t;
+    double pc;
+    work_setup();
+    srand(rngseed);
+    lg("%d hidden units, %s precision weights, %s layout\n", nhid, sizeof(real) == sizeof(float) ? "single" : "double", HLAYOUT);
     for (j=0; j<NMOVIES; j++) {
-        for (i=0; i<TOTAL_FEATURES; i++) {
-            vishid[j][0][i] = 0.02 * randn() - 0.01; // Normal Distribution
-            vishid[j][1][i] = 0.02 * randn() - 0.01; // Normal Distribution
-            vishid[j][2][i] = 0.02 * randn() - 0.01; // Normal Distribution
-            vishid[j][3][i] = 0.02 * randn() - 0.01; // Normal Distribution
-            vishid[j][4][i] = 0.02 * randn() - 0.01; // Normal Distribution
+        for (i=0; i<nhid; i++) {
+            HMOV(vishid,j)[HIDX(0,i)] = 0.02 * randn() - 0.01; // Normal Distribution
+            HMOV(vishid,j)[HIDX(1,i)] = 0.02 * randn() - 0.01; // Normal Distribution
+            HMOV(vishid,j)[HIDX(2,i)] = 0.02 * randn() - 0.01; // Normal Distribution
+            HMOV(vishid,j)[HIDX(3,i)] = 0.02 * randn() - 0.01; // Normal Distribution
+            HMOV(vishid,j)[HIDX(4,i)] = 0.02 * randn() - 0.01; // Normal Distribution
         }
     }
 
     /* Initial biases */
-    for(i=0;i<TOTAL_FEATURES;i++) {
+    for(i=0;i<nhid;i++) {
         hidbiases[i]=0.0;
     }
     for (j=0; j<NMOVIES; j++) {
@@ -236,14 +932,33 @@ int doAllFeatures() {
     double EpsilonVB = epsilonvb;
     double EpsilonHB = epsilonhb;
     double Momentum  = momentum;
-    ZERO(CDinc);
+    memset(CDinc, 0, (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real));
     ZERO(visbiasinc);
-    ZERO(hidbiasinc);
+    HZERO(hidbiasinc);
     int tSteps = 1;
 
+    // Resume from the state at the end of the checkpointed epoch
+    if ( load_model ) {
+        struct ckhead ck;
+        struct cksec sec[8];
+        ckpt_load(ckpt_path, &ck, "rbm", sec, ckpt_sections(sec));
+        rngseed    = ck.rngseed;
+        loopcount  = ck.loopcount;
+        tSteps     = ck.tSteps;
+        nrmse      = ck.nrmse;
+        prmse      = ck.prmse;
+        last_rmse  = ck.last_rmse;
+        last_prmse = ck.last_prmse;
+        EpsilonW   = ck.EpsilonW;
+        EpsilonVB  = ck.EpsilonVB;
+        EpsilonHB  = ck.EpsilonHB;
+        Momentum   = ck.Momentum;
+        lg("Resuming after epoch %d\n", loopcount);
+    }
+
     // Iterate through the model while the RMSE is decreasing 
     //while ( ((nrmse < (last_rmse-E) && prmse<last_prmse) || loopcount < 14) && loopcount < 80  )  {
-    while ( ((nrmse < (last_rmse-E) ) || loopcount < 14) && loopcount < 80  )  {
+    while ( maxepochs ? loopcount < maxepochs : ((nrmse < (last_rmse-E) ) || loopcount < 14) && loopcount < 80  )  {
 
         if ( loopcount >= 10 )
             tSteps = 3 + (loopcount - 10)/5;
@@ -251,331 +966,149 @@ int doAllFeatures() {
         last_rmse=nrmse;
         last_prmse=prmse;
         clock_t t0=clock();
+        double wt0=wtime();
         loopcount++;
-        int ntrain = 0;
-        nrmse = 0.0;
-        s  = 0.0;
-        n = 0;
 
         if ( loopcount > 5 )
             Momentum = finalmomentum;
 
         //* CDpos =0, CDneg=0 (matrices)
-        ZERO(CDpos);
-        ZERO(CDneg);
-        ZERO(poshidact);
-        ZERO(neghidact);
-        ZERO(posvisact);
-        ZERO(negvisact);
-        ZERO(moviecount);
+        for(t=0;t<nthreads;t++) {
+            struct rbmwork *w = work[t];
+            HZERO(w->poshidact);
+            HZERO(w->neghidact);
+            w->ntrain = 0;
+            w->n = 0;
+        }
 
         int u,m, f;
-        for(u=0;u<NUSERS;u++) {
-
-            //* Clear summations for probabilities
-            ZERO(negvisprobs);
-            ZERO(nvp2);
-
-            //* perform steps 1 to 8
-            int base0=useridx[u][0];
-            int d0=UNTRAIN(u);
-            int dall=UNALL(u);
-
-            // For all rated movies, accumulate contributions to hidden units
-            double sumW[TOTAL_FEATURES];
-            ZERO(sumW);
-            for(j=0;j<d0;j++) {
-                int m=userent[base0+j]&USER_MOVIEMASK;
-                moviecount[m]++;
-
-                // 1. get one data point from data set.
-                // 2. use values of this data point to set state of visible neurons Si
-                int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
-
-                // Add to the bias contribution for set visible units
-                posvisact[m][r] += 1.0;
- 
-                // for all hidden units h:
-                for(h=0;h<TOTAL_FEATURES;h++) {
-                    // sum_j(W[i][j] * v[0][j]))
-                    sumW[h]  += vishid[m][r][h];
+        struct rbmwork *w0 = work[0];
+        int bsize = BATCHSIZE;
+        for(u=0;u<NUSERS;u+=bsize) {
+            // Split the batch between the threads
+            struct batch b;
+            b.u0 = u;
+            b.u1 = u + bsize;
+            if ( b.u1 > NUSERS ) b.u1 = NUSERS;
+            b.tSteps = tSteps;
+            b.epoch = loopcount;
+            parallel(nthreads, train_batch, &b);
+            PH_START(&pc, 0);
+
+            if ( nthreads > 1 ) {
+                for(t=1;t<nthreads;t++) {
+                    struct rbmwork *w = work[t];
+                    for(i=0;i<w->ntouched;i++)
+                        if ( w0->slot[w->touched[i]] < 0 ) touch(w0, w->touched[i]);
                 }
-            }
-
-            // Sample the hidden units state after computing probabilities
-            for(h=0;h<TOTAL_FEATURES;h++) {
-
-                // 3. compute Sj for each hidden neuron based on formula above and states of visible neurons Si
-                // poshidprobs[h] = 1./(1 + exp(-V*vishid - hidbiases);
-                // compute Q(h[0][i] = 1 | v[0]) # for binomial units, sigmoid(b[i] + sum_j(W[i][j] * v[0][j]))
-                poshidprobs[h]  = 1.0/(1.0 + exp(-sumW[h] - hidbiases[h]));
-
-                // sample h[0][i] from Q(h[0][i] = 1 | v[0])
-                if  ( poshidprobs[h] >  (rand()/(double)(RAND_MAX)) ) {
-                    poshidstates[h]=1;
-                    poshidact[h] += 1.0;
-                } else {
-                    poshidstates[h]=0;
-                }
-            }
-
-            // Load up a copy of poshidstates for use in loop
-            for ( h=0; h < TOTAL_FEATURES; h++ ) 
-                curposhidstates[h] = poshidstates[h];
-
-            // Make T Contrastive Divergence steps
-            int stepT = 0;
-            do {
-                // Determine if this is the last pass through this loop
-                int finalTStep = (stepT+1 >= tSteps);
-                
-                // 5. on visible neurons compute Si using the Sj computed in step3. This is known as reconstruction
-                // for all visible units j:
-                int r;
-                int count = d0;
-                count += useridx[u][2];  // too compute probe errors
-                for(j=0;j<count;j++) {
-                    int m=userent[base0+j]&USER_MOVIEMASK;
-                    for(h=0;h<TOTAL_FEATURES;h++) {
-                        // Accumulate Weight values for sampled hidden states == 1
-                        if ( curposhidstates[h] == 1 ) {
-                            for(r=0;r<SOFTMAX;r++) {
-                                negvisprobs[m][r]  += vishid[m][r][h];
-                            }
-                        }
-
-                        // Compute more accurate probabilites for RMSE reporting
-                        if ( stepT == 0 ) {  
-                            for(r=0;r<SOFTMAX;r++) 
-                                nvp2[m][r] += poshidprobs[h] * vishid[m][r][h];
-                        }
-                    }
-
-                    // compute P(v[1][j] = 1 | h[0]) # for binomial units, sigmoid(c[j] + sum_i(W[i][j] * h[0][i]))
-                    // Softmax elements are handled individually here
-                    negvisprobs[m][0]  = 1./(1 + exp(-negvisprobs[m][0] - visbiases[m][0]));
-                    negvisprobs[m][1]  = 1./(1 + exp(-negvisprobs[m][1] - visbiases[m][1]));
-                    negvisprobs[m][2]  = 1./(1 + exp(-negvisprobs[m][2] - visbiases[m][2]));
-                    negvisprobs[m][3]  = 1./(1 + exp(-negvisprobs[m][3] - visbiases[m][3]));
-                    negvisprobs[m][4]  = 1./(1 + exp(-negvisprobs[m][4] - visbiases[m][4]));
-
-                    // Normalize probabilities
-                    double tsum  = 
-                      negvisprobs[m][0] +
-                      negvisprobs[m][1] +
-                      negvisprobs[m][2] +
-                      negvisprobs[m][3] +
-                      negvisprobs[m][4];
-                    if ( tsum != 0 ) {
-                        negvisprobs[m][0]  /= tsum;
-                        negvisprobs[m][1]  /= tsum;
-                        negvisprobs[m][2]  /= tsum;
-                        negvisprobs[m][3]  /= tsum;
-                        negvisprobs[m][4]  /= tsum;
-                    }
-                    // Compute and Normalize more accurate RMSE reporting probabilities
-                    if ( stepT == 0) {
-                        nvp2[m][0]  = 1./(1 + exp(-nvp2[m][0] - visbiases[m][0]));
-                        nvp2[m][1]  = 1./(1 + exp(-nvp2[m][1] - visbiases[m][1]));
-                        nvp2[m][2]  = 1./(1 + exp(-nvp2[m][2] - visbiases[m][2]));
-                        nvp2[m][3]  = 1./(1 + exp(-nvp2[m][3] - visbiases[m][3]));
-                        nvp2[m][4]  = 1./(1 + exp(-nvp2[m][4] - visbiases[m][4]));
-                        double tsum2  = 
-                          nvp2[m][0] +
-                          nvp2[m][1] +
-                          nvp2[m][2] +
-                          nvp2[m][3] +
-                          nvp2[m][4];
-                        if ( tsum2 != 0 ) {
-                            nvp2[m][0]  /= tsum2;
-                            nvp2[m][1]  /= tsum2;
-                            nvp2[m][2]  /= tsum2;
-                            nvp2[m][3]  /= tsum2;
-                            nvp2[m][4]  /= tsum2;
-                        }
-                    }
-
-                    // sample v[1][j] from P(v[1][j] = 1 | h[0])
-                    double randval = (rand()/(double)(RAND_MAX));
-                    if ( (randval -= negvisprobs[m][0]) <= 0.0 )
-                        negvissoftmax[m] = 0;
-                    else if ( (randval -= negvisprobs[m][1]) <= 0.0 )
-                        negvissoftmax[m] = 1;
-                    else if ( (randval -= negvisprobs[m][2]) <= 0.0 )
-                        negvissoftmax[m] = 2;
-                    else if ( (randval -= negvisprobs[m][3]) <= 0.0 )
-                        negvissoftmax[m] = 3;
-                    else //if ( (randval -= negvisprobs[m][4]) <= 0.0 )
-                        negvissoftmax[m] = 4;
-
-                    // if in training data then train on it
-                    if ( j < d0 && finalTStep )  
-                        negvisact[m][negvissoftmax[m]] += 1.0;
-                }
-
-
-                // 6. compute state of hidden neurons Sj again using Si from 5 step.
-                // For all rated movies accumulate contributions to hidden units from sampled visible units
-                ZERO(sumW);
-                for(j=0;j<d0;j++) {
-                    int m=userent[base0+j]&USER_MOVIEMASK;
-     
-                    // for all hidden units h:
-                    for(h=0;h<TOTAL_FEATURES;h++) {
-                        sumW[h]  += vishid[m][negvissoftmax[m]][h];
-                    }
-                }
-                // for all hidden units h:
-                for(h=0;h<TOTAL_FEATURES;h++) {
-                    // compute Q(h[1][i] = 1 | v[1]) # for binomial units, sigmoid(b[i] + sum_j(W[i][j] * v[1][j]))
-                    neghidprobs[h]  = 1./(1 + exp(-sumW[h] - hidbiases[h]));
-
-                    // Sample the hidden units state again.
-                    if  ( neghidprobs[h] >  (rand()/(double)(RAND_MAX)) ) {
-                        neghidstates[h]=1;
-                        if ( finalTStep )
-                            neghidact[h] += 1.0;
-                    } else {
-                        neghidstates[h]=0;
-                    }
-                }
-
-                // Compute error rmse and prmse before we start iterating on T
-                if ( stepT == 0 ) {
-
-                    // Compute rmse on training data
-                    for(j=0;j<d0;j++) {
-                        int m=userent[base0+j]&USER_MOVIEMASK;
-                        int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
-         
-                        //# Compute some error function like sum of squared difference between Si in 1) and Si in 5)
-                        double expectedV = nvp2[m][1] + 2.0 * nvp2[m][2] + 3.0 * nvp2[m][3] + 4.0 * nvp2[m][4];
-                        double vdelta = (((double)r)-expectedV);
-                        nrmse += (vdelta * vdelta);
-                    }
-                    ntrain+=d0;
-
-                    // Sum up probe rmse
-                    int base=useridx[u][0];
-                    for(i=1;i<2;i++) base+=useridx[u][i];
-                    int d=useridx[u][2];
-                    for(i=0; i<d;i++) {
-                        int m=userent[base+i]&USER_MOVIEMASK;
-                        int r=(userent[base+i]>>USER_LMOVIEMASK)&7;
-                        //# Compute some error function like sum of squared difference between Si in 1) and Si in 5)
-                        double expectedV = nvp2[m][1] + 2.0 * nvp2[m][2] + 3.0 * nvp2[m][3] + 4.0 * nvp2[m][4];
-                        double vdelta = (((double)r)-expectedV);
-                        s+=vdelta*vdelta;
-                    }
-                    n+=d;
-                }
-
-                // If looping again, load the curposvisstates
-                if ( !finalTStep ) {
-                    for ( h=0; h < TOTAL_FEATURES; h++ ) 
-                        curposhidstates[h] = neghidstates[h];
-                    ZERO(negvisprobs);
-                }
-
-              // 8. repeating multiple times steps 5,6 and 7 compute (Si.Sj)n. Where n is small number and can 
-              //    increase with learning steps to achieve better accuracy.
-
-            } while ( ++stepT < tSteps );
-
-            // Accumulate contrastive divergence contributions for (Si.Sj)0 and (Si.Sj)T
-            for(j=0;j<d0;j++) {
-                int m=userent[base0+j]&USER_MOVIEMASK;
-                int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
- 
-                // for all hidden units h:
-                for(h=0;h<TOTAL_FEATURES;h++) {
-                    if ( poshidstates[h] == 1 ) {
-                        // 4. now Si and Sj values can be used to compute (Si.Sj)0  here () means just values not average
-                        //* accumulate CDpos = CDpos + (Si.Sj)0
-                        CDpos[m][r][h] += 1.0;
-                    }
-
-                    // 7. now use Si and Sj to compute (Si.Sj)1 (fig.3)
-                    CDneg[m][negvissoftmax[m]][h] += (double)neghidstates[h];
+                parallel(nthreads, reduce_batch, NULL);
+                for(t=1;t<nthreads;t++) {
+                    work[t]->ntouched = 0;
+                    dvadd(w0->poshidact, work[t]->poshidact, nhid);
+                    dvadd(w0->neghidact, work[t]->neghidact, nhid);
+                    HZERO(work[t]->poshidact);
+                    HZERO(work[t]->neghidact);
                 }
             }
 
             // Update weights and biases after batch
             //
-            int bsize = 100;
-            if ( ((u+1) % bsize) == 0 || (u+1) == NUSERS ) {
-                int numcases = u % bsize;
-                numcases++;
-
-                // Update weights
-                for(m=0;m<NMOVIES;m++) {
-                    if ( moviecount[m] == 0 ) continue;
-
-                    // for all hidden units h:
-                    for(h=0;h<TOTAL_FEATURES;h++) {
-                        // for all softmax
-                        int rr;
-                        for(rr=0;rr<SOFTMAX;rr++) {
-                            //# At the end compute average of CDpos and CDneg by dividing them by number of data points.
-                            //# Compute CD = < Si.Sj >0  < Si.Sj >n = CDpos  CDneg
-                            double CDp = CDpos[m][rr][h];
-                            double CDn = CDneg[m][rr][h];
-                            if ( CDp != 0.0 || CDn != 0.0 ) {
-                                CDp /= ((double)moviecount[m]);
-                                CDn /= ((double)moviecount[m]);
-
-                                // W += epsilon * (h[0] * v[0]' - Q(h[1][.] = 1 | v[1]) * v[1]')
-                                //# Update weights and biases W = W + alpha*CD (biases are just weights to neurons that stay always 1.0)
-                                //e.g between data and reconstruction.
-                                CDinc[m][rr][h] = Momentum * CDinc[m][rr][h] + EpsilonW * ((CDp - CDn) - weightcost * vishid[m][rr][h]);
-                                vishid[m][rr][h] += CDinc[m][rr][h];
-                            } 
-                        }
-                    }
+            int numcases = b.u1 - b.u0;
+
+            // Update weights
+            for(i=0;i<w0->ntouched;i++) {
+                m = w0->touched[i];
+                real *cdp = HMOV(w0->CDpos,i);
+                real *cdn = HMOV(w0->CDneg,i);
+                real *inc = HMOV(CDinc,m);
+                real *wt  = HMOV(vishid,m);
 
-                    // Update visible softmax biases
-                    // c += epsilon * (v[0] - v[1])$
+                // for all hidden units h:
+                for(h=0;h<nhid;h++) {
                     // for all softmax
                     int rr;
                     for(rr=0;rr<SOFTMAX;rr++) {
-                        if ( posvisact[m][rr] != 0.0 || negvisact[m][rr] != 0.0 ) {
-                            posvisact[m][rr] /= ((double)moviecount[m]);
-                            negvisact[m][rr] /= ((double)moviecount[m]);
-                            visbiasinc[m][rr] = Momentum * visbiasinc[m][rr] + EpsilonVB * ((posvisact[m][rr] - negvisact[m][rr]));
-                            //visbiasinc[m][rr] = Momentum * visbiasinc[m][rr] + EpsilonVB * ((posvisact[m][rr] - negvisact[m][rr]) - weightcost * visbiases[m][rr]);
-                            visbiases[m][rr]  += visbiasinc[m][rr];
-                        }
+                        int e = HIDX(rr,h);
+                        //# At the end compute average of CDpos and CDneg by dividing them by number of data points.
+                        //# Compute CD = < Si.Sj >0  < Si.Sj >n = CDpos  CDneg
+                        double CDp = cdp[e];
+                        double CDn = cdn[e];
+                        if ( CDp != 0.0 || CDn != 0.0 ) {
+                            CDp /= ((double)w0->moviecount[m]);
+                            CDn /= ((double)w0->moviecount[m]);
+
+                            // W += epsilon * (h[0] * v[0]' - Q(h[1][.] = 1 | v[1]) * v[1]')
+                            //# Update weights and biases W = W + alpha*CD (biases are just weights to neurons that stay always 1.0)
+                            //e.g between data and reconstruction.
+                            inc[e] = Momentum * inc[e] + EpsilonW * ((CDp - CDn) - weightcost * wt[e]);
+                            wt[e] += inc[e];
+                        } 
                     }
                 }
 
-                
-                // Update hidden biases
-                // b += epsilon * (h[0] - Q(h[1][.] = 1 | v[1]))
-                for(h=0;h<TOTAL_FEATURES;h++) {
-                    if ( poshidact[h]  != 0.0 || neghidact[h]  != 0.0 ) {
-                        poshidact[h]  /= ((double)(numcases));
-                        neghidact[h]  /= ((double)(numcases));
-                        hidbiasinc[h] = Momentum * hidbiasinc[h] + EpsilonHB * ((poshidact[h] - neghidact[h]));
-                        //hidbiasinc[h] = Momentum * hidbiasinc[h] + EpsilonHB * ((poshidact[h] - neghidact[h]) - weightcost * hidbiases[h]);
-                        hidbiases[h]  += hidbiasinc[h];
+                // Update visible softmax biases
+                // c += epsilon * (v[0] - v[1])$
+                // for all softmax
+                int rr;
+                for(rr=0;rr<SOFTMAX;rr++) {
+                    if ( w0->posvisact[i][rr] != 0.0 || w0->negvisact[i][rr] != 0.0 ) {
+                        w0->posvisact[i][rr] /= ((double)w0->moviecount[m]);
+                        w0->negvisact[i][rr] /= ((double)w0->moviecount[m]);
+                        visbiasinc[m][rr] = Momentum * visbiasinc[m][rr] + EpsilonVB * ((w0->posvisact[i][rr] - w0->negvisact[i][rr]));
+                        //visbiasinc[m][rr] = Momentum * visbiasinc[m][rr] + EpsilonVB * ((posvisact[m][rr] - negvisact[m][rr]) - weightcost * visbiases[m][rr]);
+                        visbiases[m][rr]  += visbiasinc[m][rr];
                     }
                 }
-                ZERO(CDpos);
-                ZERO(CDneg);
-                ZERO(poshidact);
-                ZERO(neghidact);
-                ZERO(posvisact);
-                ZERO(negvisact);
-                ZERO(moviecount);
             }
+
+            
+            // Update hidden biases
+            // b += epsilon * (h[0] - Q(h[1][.] = 1 | v[1]))
+            for(h=0;h<nhid;h++) {
+                if ( w0->poshidact[h]  != 0.0 || w0->neghidact[h]  != 0.0 ) {
+                    w0->poshidact[h]  /= ((double)(numcases));
+                    w0->neghidact[h]  /= ((double)(numcases));
+                    hidbiasinc[h] = Momentum * hidbiasinc[h] + EpsilonHB * ((w0->poshidact[h] - w0->neghidact[h]));
+                    //hidbiasinc[h] = Momentum * hidbiasinc[h] + EpsilonHB * ((poshidact[h] - neghidact[h]) - weightcost * hidbiases[h]);
+                    hidbiases[h]  += hidbiasinc[h];
+                }
+            }
+            // Clear only the rows this batch used
+            memset(w0->CDpos, 0, (size_t)w0->ntouched*SOFTMAX*hstride*sizeof(real));
+            memset(w0->CDneg, 0, (size_t)w0->ntouched*SOFTMAX*hstride*sizeof(real));
+            memset(w0->posvisact, 0, w0->ntouched*sizeof(w0->posvisact[0]));
+            memset(w0->negvisact, 0, w0->ntouched*sizeof(w0->negvisact[0]));
+            for(i=0;i<w0->ntouched;i++) {
+                m = w0->touched[i];
+                w0->moviecount[m] = 0;
+                w0->slot[m] = -1;
+            }
+            w0->ntouched = 0;
+            HZERO(w0->poshidact);
+            HZERO(w0->neghidact);
+            PH_LAP(&pc, 0, PH_UPDATE);
         }
 
+        int ntrain = 0;
+        nrmse = 0.0;
+        s  = 0.0;
+        n = 0;
+        for(t=0;t<nthreads;t++) {
+            ntrain += work[t]->ntrain;
+            n += work[t]->n;
+        }
+        for(u=0;u<NUSERS;u++) {
+            nrmse += usqerr[u][0];
+            s += usqerr[u][1];
+        }
         nrmse=sqrt(nrmse/ntrain);
         prmse = sqrt(s/n);
         
-        lg("%f\t%f\t%f\n",nrmse,prmse,(clock()-t0)/(double)CLOCKS_PER_SEC);
+        double wt=wtime()-wt0;
+        lg("%f\t%f\t%f\t%f\n",nrmse,prmse,(clock()-t0)/(double)CLOCKS_PER_SEC,wt);
+        lg("%.0f ratings/sec, %s engine\n", ntrain/(wt > 0 ? wt : 1e-9), gemm_engine ? "batched" : "scalar");
 
-        if ( TOTAL_FEATURES == 200 ) {
+        if ( nhid >= 200 ) {  // 200 or more hidden variables
             if ( loopcount > 6 ) {
                 EpsilonW  *= 0.90;
                 EpsilonVB *= 0.90;
@@ -604,15 +1137,40 @@ int doAllFeatures() {
                 EpsilonHB *= 0.78;
             }
         }
+
+        if ( save_model ) {
+            struct ckhead ck;
+            struct cksec sec[8];
+            ckpt_head(&ck, "rbm");
+            ck.rngseed    = rngseed;
+            ck.loopcount  = loopcount;
+            ck.tSteps     = tSteps;
+            ck.nrmse      = nrmse;
+            ck.prmse      = prmse;
+            ck.last_rmse  = last_rmse;
+            ck.last_prmse = last_prmse;
+            ck.EpsilonW   = EpsilonW;
+            ck.EpsilonVB  = EpsilonVB;
+            ck.EpsilonHB  = EpsilonHB;
+            ck.Momentum   = Momentum;
+            PH_START(&pc, 0);
+            ckpt_save(ckpt_path, &ck, sec, ckpt_sections(sec));
+            PH_LAP(&pc, 0, PH_IO);
+        }
+        prof_report("rbm", loopcount);
     }
+    PH_START(&pc, 0);
+    dump_wait();
+    if ( save_model )
+        model_save(model_path, "rbm", vishid, &visbiases[0][0], hidbiases, NULL);
+    PH_LAP(&pc, 0, PH_IO);
     
     /* Perform a final iteration in which the errors are clipped and stored */
     recordErrors();
-    
-    //if(save_model) {
-        //dappend_bin(fnameV,sV,NMOVIES);
-        //dappend_bin(fnameU,sU,NUSERS);
-    //}
+    PH_START(&pc, 0);
+    dump_wait();
+    PH_LAP(&pc, 0, PH_IO);
+    prof_report("rbm", 0);
     
     return 1;
 }
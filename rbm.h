@@ -0,0 +1,383 @@
+/*
+########################################################################
+#  Netflix Prize Tools
+#  Copyright (C) 2009 Greg Bildson
+#  http://code.google.com/p/nprizeadditions/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+########################################################################
+*/
+/*   rbm.h
+     Definitions shared by rbm.c and rbmcond.c: the precision of the weights,
+     the number of hidden units and the kernels that run over them.
+     Include basic.h first, the checkpoint and model code logs with lg().
+*/
+#define SOFTMAX         5
+#define DEFAULT_HIDDEN  100
+
+// Build with -DRBM_FLOAT (make rbmf, rbmcondf) to keep the weights and CD
+// statistics in single precision.
+#ifdef RBM_FLOAT
+typedef float real;
+#define rvadd fvadd
+#else
+typedef double real;
+#define rvadd dvadd
+#endif
+
+// Every vector over the hidden units is padded to a whole number of SIMD
+// vectors, so each row starts on a SIMD boundary and the h loops have no
+// remainder.  The padding entries stay zero.
+#ifdef RBM_TILED
+#define SIMDBYTES       64
+#else
+#define SIMDBYTES       32
+#endif
+#define HPAD(n)         ((int)(((n)*sizeof(real)+SIMDBYTES-1)/SIMDBYTES*SIMDBYTES/sizeof(real)))
+
+// Number of hidden units (-nh) and the padded length of a hidden vector
+extern int nhid;
+extern int hstride;
+
+// Row m of a [NMOVIES][hstride] array
+#define HVEC(a,m)       ((a)+(size_t)(m)*hstride)
+#define HZERO(v)        memset((v),0,hstride*sizeof(*(v)))
+
+// The weights of movie m, and the CD statistics laid out like them, are one
+// block of SOFTMAX*hstride entries: HMOV(a,m) is the block and HIDX(r,h) the
+// offset of rating r, hidden unit h in it.  The kernels walk a block in
+// groups of HT hidden units; HTILE(b,t) is the group starting at unit t and
+// HRS the distance between its ratings.
+//
+// By default a block is SOFTMAX rows of hstride, [r][h].  Build with
+// -DRBM_TILED (make rbmt, rbmcondt) to store it as [h/HT][r][HT] tiles, HT
+// hidden units being one cache line.  The up pass then still reads whole
+// cache lines of one rating, while the down pass reads the five ratings of
+// a group of hidden units from one line each, walking the block front to
+// back in a single stream instead of five.
+#define HMOV(a,m)       ((a)+(size_t)(m)*SOFTMAX*hstride)
+#define HT              ((int)(SIMDBYTES/sizeof(real)))
+#ifdef RBM_TILED
+#define HIDX(r,h)       (((h)-(h)%HT)*SOFTMAX+(r)*HT+(h)%HT)
+#define HTILE(b,t)      ((b)+(t)*SOFTMAX)
+#define HRS             HT
+#define HLAYOUT         "tiled"
+#else
+#define HIDX(r,h)       ((r)*hstride+(h))
+#define HTILE(b,t)      ((b)+(t))
+#define HRS             hstride
+#define HLAYOUT         "row"
+#endif
+
+// Kernels over the hidden units.  The sizes in common use get their own copy
+// with the length known at compile time, so the compiler can unroll and
+// vectorize them; hk_setup() picks the set matching nhid.
+struct hkernels {
+    void   (*add)(real *s, real *v);                // s += v
+    void   (*addrow)(real *s, real *b, int r);      // s += row r of the block b
+    void   (*dotrows)(real *a, real *b, double *out); // out[r] = a.(row r of b)
+    void   (*dotrows4)(real **a, real *b, double **out); // dotrows for a[0..3]
+};
+static struct hkernels hk;
+
+#define HADDROW(s,b,r,n) { \
+    int t,k; \
+    for(t=0;t<(n);t+=HT) { \
+        real *v=HTILE(b,t)+(r)*HRS; \
+        for(k=0;k<HT;k++) \
+            (s)[t+k]+=v[k]; \
+    } \
+}
+
+// The dot products are summed in the same order for both layouts, 8 partial
+// sums in single precision (like ffvdot) and one running sum in double
+// precision, so the layout does not change the results.  HDOTROWS4 does four
+// vectors against the same block, loading each weight once for all four and
+// summing each product in the same order as HDOTROWS.
+#ifdef RBM_FLOAT
+#define HDOTROWS(a,b,out,n) { \
+    float s[SOFTMAX][8]; \
+    int t,k,r; \
+    memset(s,0,sizeof(s)); \
+    for(t=0;t<(n);t+=HT) { \
+        real *v=HTILE(b,t); \
+        for(r=0;r<SOFTMAX;r++) \
+            for(k=0;k<HT;k++) \
+                s[r][k%8]+=(a)[t+k]*v[r*HRS+k]; \
+    } \
+    for(r=0;r<SOFTMAX;r++) \
+        (out)[r]=((s[r][0]+s[r][4])+(s[r][1]+s[r][5]))+((s[r][2]+s[r][6])+(s[r][3]+s[r][7])); \
+}
+#define HDOTROWS4(a,b,out,n) { \
+    float s[4][SOFTMAX][8]; \
+    int t,k,r,i; \
+    memset(s,0,sizeof(s)); \
+    for(t=0;t<(n);t+=HT) { \
+        real *v=HTILE(b,t); \
+        for(r=0;r<SOFTMAX;r++) \
+            for(k=0;k<HT;k++) { \
+                real x=v[r*HRS+k]; \
+                for(i=0;i<4;i++) \
+                    s[i][r][k%8]+=(a)[i][t+k]*x; \
+            } \
+    } \
+    for(i=0;i<4;i++) \
+        for(r=0;r<SOFTMAX;r++) \
+            (out)[i][r]=((s[i][r][0]+s[i][r][4])+(s[i][r][1]+s[i][r][5]))+((s[i][r][2]+s[i][r][6])+(s[i][r][3]+s[i][r][7])); \
+}
+#else
+#define HDOTROWS(a,b,out,n) { \
+    double s[SOFTMAX]; \
+    int t,k,r; \
+    for(r=0;r<SOFTMAX;r++) \
+        s[r]=0.; \
+    for(t=0;t<(n);t+=HT) { \
+        real *v=HTILE(b,t); \
+        for(k=0;k<HT;k++) \
+            for(r=0;r<SOFTMAX;r++) \
+                s[r]+=(a)[t+k]*v[r*HRS+k]; \
+    } \
+    for(r=0;r<SOFTMAX;r++) \
+        (out)[r]=s[r]; \
+}
+#define HDOTROWS4(a,b,out,n) { \
+    double s[4][SOFTMAX]; \
+    int t,k,r,i; \
+    memset(s,0,sizeof(s)); \
+    for(t=0;t<(n);t+=HT) { \
+        real *v=HTILE(b,t); \
+        for(k=0;k<HT;k++) \
+            for(r=0;r<SOFTMAX;r++) { \
+                real x=v[r*HRS+k]; \
+                for(i=0;i<4;i++) \
+                    s[i][r]+=(a)[i][t+k]*x; \
+            } \
+    } \
+    for(i=0;i<4;i++) \
+        for(r=0;r<SOFTMAX;r++) \
+            (out)[i][r]=s[i][r]; \
+}
+#endif
+
+#define HKERNELS(N) \
+static void hadd_##N(real *s, real *v) { int h; for(h=0;h<HPAD(N);h++) s[h]+=v[h]; } \
+static void haddrow_##N(real *s, real *b, int r) HADDROW(s,b,r,HPAD(N)) \
+static void hdotrows_##N(real *a, real *b, double *out) HDOTROWS(a,b,out,HPAD(N)) \
+static void hdotrows4_##N(real **a, real *b, double **out) HDOTROWS4(a,b,out,HPAD(N))
+
+HKERNELS(50)
+HKERNELS(100)
+HKERNELS(200)
+HKERNELS(400)
+
+// Any other nhid
+static void hadd_any(real *s, real *v) { int h; for(h=0;h<hstride;h++) s[h]+=v[h]; }
+static void haddrow_any(real *s, real *b, int r) HADDROW(s,b,r,hstride)
+static void hdotrows_any(real *a, real *b, double *out) HDOTROWS(a,b,out,hstride)
+static void hdotrows4_any(real **a, real *b, double **out) HDOTROWS4(a,b,out,hstride)
+
+#define HK_SET(N) { hk.add = hadd_##N; hk.addrow = haddrow_##N; hk.dotrows = hdotrows_##N; hk.dotrows4 = hdotrows4_##N; }
+
+static void hk_setup() {
+    switch ( nhid ) {
+        case 50:  HK_SET(50);  break;
+        case 100: HK_SET(100); break;
+        case 200: HK_SET(200); break;
+        case 400: HK_SET(400); break;
+        default:  HK_SET(any); break;
+    }
+}
+
+// Sampled binary hidden states are bitsets of HWORDS words, unit h being bit
+// h%64 of word h/64.  HFOREACH(bits,h) runs the statement that follows with
+// h set to each unit that is on, in increasing order, skipping 64 units that
+// are off at a time.
+#define HWORDS          ((nhid+63)/64)
+#define HFOREACH(bits,h) \
+    for(int h##_w=0; h##_w<HWORDS; h##_w++) \
+        for(uint64_t h##_x=(bits)[h##_w]; h##_x && ((h)=h##_w*64+__builtin_ctzll(h##_x),1); h##_x&=h##_x-1)
+
+// Set bit h of bits to on (0 or 1) without branching on it
+#define HSETBIT(bits,h,on) ((bits)[(h)>>6] |= (uint64_t)(on)<<((h)&63))
+
+// Reconstruction from binary hidden states: out[r] is the sum of row r of the
+// block b over the hidden units on in bits.  This is the dot product with a
+// 0/1 state vector, summed in the same order, without visiting the units
+// that are off.
+static void hsumrows(real *b, uint64_t *bits, double *out) {
+    real s[SOFTMAX];
+    int h, r;
+    for(r=0;r<SOFTMAX;r++)
+        s[r] = 0.;
+    HFOREACH(bits,h) {
+        for(r=0;r<SOFTMAX;r++)
+            s[r] += b[HIDX(r,h)];
+    }
+    for(r=0;r<SOFTMAX;r++)
+        out[r] = s[r];
+}
+
+// Checkpoints.  With -sm the training state is written at the end of every
+// epoch to ckpt_path (-ckpt <fname>) by a background thread, as a temporary
+// file renamed into place, so there is always one complete checkpoint.  -lm
+// loads it and goes on with the next epoch exactly as the run that wrote it
+// would have.  A checkpoint is a struct ckhead followed by the sections the
+// model lists, each stored as it is laid out in memory.
+#define CKPT_MAGIC      0x50434252      // "RBCP"
+#define CKPT_VERSION    1
+
+struct ckhead {
+    unsigned int magic, version;
+    char   model[16];
+    int    nmovies, softmax, nhid, hstride, realsize, tiled;
+    unsigned int rngseed;
+    // Schedule state at the end of epoch loopcount
+    int    loopcount, tSteps;
+    double nrmse, prmse, last_rmse, last_prmse;
+    double EpsilonW, EpsilonD, EpsilonVB, EpsilonHB, Momentum;
+};
+
+struct cksec {
+    void   *p;
+    size_t len;
+};
+
+// Fill in the fields of h that describe this build
+static void ckpt_head(struct ckhead *h, char *model) {
+    memset(h, 0, sizeof(*h));
+    h->magic    = CKPT_MAGIC;
+    h->version  = CKPT_VERSION;
+    strncpy(h->model, model, sizeof(h->model)-1);
+    h->nmovies  = NMOVIES;
+    h->softmax  = SOFTMAX;
+    h->nhid     = nhid;
+    h->hstride  = hstride;
+    h->realsize = sizeof(real);
+#ifdef RBM_TILED
+    h->tiled    = 1;
+#endif
+}
+
+// Copy h and the sections s[0..n-1] and write the copy in the background
+static void ckpt_save(char *path, struct ckhead *h, struct cksec *s, int n) {
+    size_t len = sizeof(*h);
+    char *buf, *p;
+    int i;
+    for(i=0;i<n;i++)
+        len += s[i].len;
+    buf = malloc(len);
+    if ( !buf ) error("Cant allocate %lu bytes for a checkpoint\n", (unsigned long)len);
+    memcpy(buf, h, sizeof(*h));
+    p = buf + sizeof(*h);
+    for(i=0;i<n;i++) {
+        memcpy(p, s[i].p, s[i].len);
+        p += s[i].len;
+    }
+    dump_bin_async(path, buf, len);
+}
+
+// Read a checkpoint written by the same model and build into h and s
+static void ckpt_load(char *path, struct ckhead *h, char *model, struct cksec *s, int n) {
+    struct ckhead want;
+    FILE *fp;
+    int i;
+    ckpt_head(&want, model);
+    lg("Loading %s\n", path);
+    fp = fopen(path, "rb");
+    if ( !fp ) error("Cant open checkpoint %s\n", path);
+    if ( fread(h, sizeof(*h), 1, fp) != 1 || h->magic != CKPT_MAGIC )
+        error("%s is not a checkpoint\n", path);
+    if ( h->version != CKPT_VERSION )
+        error("Checkpoint version %u, expected %u\n", h->version, CKPT_VERSION);
+    if ( strcmp(h->model, want.model) )
+        error("Checkpoint was written by %s, not %s\n", h->model, want.model);
+    if ( h->nhid != want.nhid )
+        error("Checkpoint has %d hidden units, run with -nh %d\n", h->nhid, h->nhid);
+    if ( h->nmovies != want.nmovies || h->softmax != want.softmax || h->hstride != want.hstride
+      || h->realsize != want.realsize || h->tiled != want.tiled )
+        error("Checkpoint was written by a build with another precision or layout\n");
+    for(i=0;i<n;i++)
+        if ( fread(s[i].p, 1, s[i].len, fp) != s[i].len )
+            error("Checkpoint %s is truncated\n", path);
+    fclose(fp);
+}
+
+// Model files.  With -sm the trained parameters are also written to
+// model_path (-model <fname>) for rbmscore.  Whatever the build, the file is
+// a struct mhead followed by the weights [NMOVIES][SOFTMAX][mstride] and, for
+// rbmcond, Dij [NMOVIES][mstride] in single precision and the default row
+// layout, then visbiases [NMOVIES][SOFTMAX] and hidbiases [mstride] in double
+// precision.  mstride is HPAD(nhid) of a single precision build and the
+// header is 64 bytes, so every array can be used in place from a mapping of
+// the file.
+#define MODEL_MAGIC     0x4d4d4252      // "RBMM"
+#define MODEL_VERSION   1
+#define MSTRIDE(n)      (((n)+7)/8*8)
+
+struct mhead {
+    unsigned int magic, version;
+    char   model[16];
+    int    nmovies, softmax, nhid, mstride;
+    int    conditional;
+    char   pad[20];
+};
+
+// Size of a model file with the given header
+static size_t model_size(struct mhead *h) {
+    return sizeof(*h) + (size_t)h->nmovies*SOFTMAX*h->mstride*sizeof(float)
+        + (h->conditional ? (size_t)h->nmovies*h->mstride*sizeof(float) : 0)
+        + (size_t)h->nmovies*SOFTMAX*sizeof(double) + h->mstride*sizeof(double);
+}
+
+// Convert the parameters to the model file format and write them in the
+// background.  dij is NULL for the pure rbm.
+static void model_save(char *path, char *model, real *w, double *vb, double *hb, real *dij) {
+    struct mhead h;
+    size_t len;
+    float *fw;
+    double *d;
+    char *buf;
+    int m, r, k;
+
+    memset(&h, 0, sizeof(h));
+    h.magic       = MODEL_MAGIC;
+    h.version     = MODEL_VERSION;
+    strncpy(h.model, model, sizeof(h.model)-1);
+    h.nmovies     = NMOVIES;
+    h.softmax     = SOFTMAX;
+    h.nhid        = nhid;
+    h.mstride     = MSTRIDE(nhid);
+    h.conditional = dij != NULL;
+    len = model_size(&h);
+    buf = calloc(1, len);
+    if ( !buf ) error("Cant allocate %lu bytes for the model\n", (unsigned long)len);
+    memcpy(buf, &h, sizeof(h));
+
+    fw = (float *)(buf + sizeof(h));
+    for(m=0;m<NMOVIES;m++)
+        for(r=0;r<SOFTMAX;r++)
+            for(k=0;k<nhid;k++)
+                fw[((size_t)m*SOFTMAX+r)*h.mstride+k] = HMOV(w,m)[HIDX(r,k)];
+    fw += (size_t)NMOVIES*SOFTMAX*h.mstride;
+    if ( dij ) {
+        for(m=0;m<NMOVIES;m++)
+            for(k=0;k<nhid;k++)
+                fw[(size_t)m*h.mstride+k] = HVEC(dij,m)[k];
+        fw += (size_t)NMOVIES*h.mstride;
+    }
+    d = (double *)fw;
+    memcpy(d, vb, NMOVIES*SOFTMAX*sizeof(double));
+    memcpy(d + NMOVIES*SOFTMAX, hb, nhid*sizeof(double));
+    dump_bin_async(path, buf, len);
+}
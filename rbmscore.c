@@ -0,0 +1,305 @@
+/*
+########################################################################
+#  Netflix Prize Tools
+#  Copyright (C) 2009 Greg Bildson
+#  http://code.google.com/p/nprizeadditions/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+########################################################################
+*/
+/*   rbmscore.c
+     Scores users with a model file written by rbm or rbmcond (-sm), without
+     training.  The users are read from a user_index/user_entry pair in the
+     usual format, with any number of users.  Each user's hidden units are
+     computed from their training ratings (and probe ratings with -a), the
+     same as the final pass of the trainer, and every one of their entries
+     gets a prediction.
+
+     The output has one float per entry of user_entry, in the same order: the
+     expected rating on the 1..5 scale.  With -q only the entries the user is
+     not conditioned on (the queries: probe and qualify, or qualify with -a)
+     are predicted and the rest are left 0.  Once a user's hidden
+     probabilities are known, each query movie costs one SOFTMAX x nhid
+     product, so this skips the bulk of the work when the users have many
+     more ratings than queries.
+
+     -q8 quantizes the weights to 8 bits with one scale per movie and rating,
+     a quarter of the memory traffic of the float weights.  Unless -a is
+     given the probe RMSE is logged, so the two can be compared.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "basic.h"
+#include "netflix.h"
+#include "utest.h"
+#include "rbm.h"
+
+int nhid;
+int hstride;
+
+char *useridx_path="data/user_index.bin";
+char *userent_path="data/user_entry.bin";
+int aopt=0;
+int nthreads=1;
+int (*useridx)[4];
+unsigned int *userent;
+int nusers;
+float *pred;
+int qopt=0;         // -q, predict the queries only
+int q8opt=0;        // -q8, 8 bit weights
+
+int8_t *qvishid;    // [NMOVIES][SOFTMAX][hstride] vishid rounded to qscale steps
+float  *qscale;     // [NMOVIES][SOFTMAX]
+
+// The model, used in place from the mapped file
+struct mhead *mh;
+real   *vishid;      // [NMOVIES][SOFTMAX][hstride]
+real   *Dij;         // [NMOVIES][hstride], rbmcond only
+double *visbiases;   // [NMOVIES][SOFTMAX]
+double *hidbiases;   // [hstride]
+
+// Per-thread scratch
+struct scorework {
+    real   *sumW;
+    real   *hidprobs;
+    double (*recon)[SOFTMAX];
+    double s;       // probe squared error and count
+    int    n;
+};
+struct scorework work[MAXTHREADS];
+
+void load_model_file(char *path) {
+    struct mhead h;
+    FILE *fp;
+    char *p;
+
+    fp = fopen(path, "rb");
+    if ( !fp ) error("Cant open model %s\n", path);
+    if ( fread(&h, sizeof(h), 1, fp) != 1 || h.magic != MODEL_MAGIC )
+        error("%s is not a model file\n", path);
+    fclose(fp);
+    if ( h.version != MODEL_VERSION )
+        error("Model version %u, expected %u\n", h.version, MODEL_VERSION);
+    if ( h.nmovies != NMOVIES || h.softmax != SOFTMAX )
+        error("Model is for %d movies and %d ratings\n", h.nmovies, h.softmax);
+
+    p = map_bin(path, model_size(&h), 0);
+    mh = (struct mhead *)p;
+    nhid = mh->nhid;
+    hstride = mh->mstride;
+    if ( hstride != HPAD(nhid) ) error("Bad model stride %d\n", hstride);
+    p += sizeof(*mh);
+    vishid = (real *)p;
+    p += (size_t)NMOVIES*SOFTMAX*hstride*sizeof(real);
+    if ( mh->conditional ) {
+        Dij = (real *)p;
+        p += (size_t)NMOVIES*hstride*sizeof(real);
+    }
+    visbiases = (double *)p;
+    hidbiases = visbiases + NMOVIES*SOFTMAX;
+    lg("%s model, %d hidden units\n", mh->model, nhid);
+}
+
+// Quantize each row of the weights to int8, scaled by its largest magnitude
+void quantize() {
+    int m, r, h;
+    qvishid = calloc((size_t)NMOVIES*SOFTMAX*hstride, 1);
+    qscale = malloc(NMOVIES*SOFTMAX*sizeof(float));
+    if ( !qvishid || !qscale ) error("Cant allocate the quantized weights\n");
+    for(m=0;m<NMOVIES;m++)
+        for(r=0;r<SOFTMAX;r++) {
+            real *w = HMOV(vishid,m) + r*hstride;
+            int8_t *q = qvishid + ((size_t)m*SOFTMAX+r)*hstride;
+            float mx = 0.;
+            for(h=0;h<nhid;h++)
+                if ( fabsf(w[h]) > mx ) mx = fabsf(w[h]);
+            qscale[m*SOFTMAX+r] = mx/127.;
+            if ( mx > 0. )
+                for(h=0;h<nhid;h++)
+                    q[h] = lrintf(w[h]*127./mx);
+        }
+    lg("Quantized the weights to 8 bits\n");
+}
+
+// out[r] = p.(row r of movie m) with the 8 bit weights
+static void qdotrows(real *p, int m, double *out) {
+    int8_t *q = qvishid + (size_t)m*SOFTMAX*hstride;
+    int r, t, k;
+    for(r=0;r<SOFTMAX;r++,q+=hstride) {
+        float s[8] = {0};
+        for(t=0;t<hstride;t+=8)
+            for(k=0;k<8;k++)
+                s[k] += p[t+k]*q[t+k];
+        out[r] = qscale[m*SOFTMAX+r] * (((s[0]+s[4])+(s[1]+s[5]))+((s[2]+s[6])+(s[3]+s[7])));
+    }
+}
+
+// Number of bytes in the file at path
+size_t file_size(char *path) {
+    struct stat st;
+    if ( stat(path, &st) ) error("Cant open %s\n", path);
+    return st.st_size;
+}
+
+// The hidden probabilities of user u given the ratings it is conditioned on,
+// then the expected rating of each of its entries (its queries with -q).
+// This is record_user() of rbm.c and rbmcond.c.
+void score_user(struct scorework *w, int u) {
+    int base0=useridx[u][0];
+    int d0=UNTRAIN(u);
+    int dall=UNALL(u);
+    int dtot=UNTOTAL(u);
+    int j0=qopt ? d0 : 0;   // first entry predicted
+    int nq=dtot-j0;
+    int h, j, r;
+
+    if ( dtot > NMOVIES ) error("User %d has %d entries\n", u, dtot);
+    HZERO(w->sumW);
+    for(j=0;j<d0;j++) {
+        int m=userent[base0+j]&USER_MOVIEMASK;
+        int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
+        hk.addrow(w->sumW, HMOV(vishid,m), r);
+    }
+    if ( Dij )
+        for(j=0;j<dall;j++)
+            hk.add(w->sumW, HVEC(Dij,userent[base0+j]&USER_MOVIEMASK));
+    for(h=0;h<nhid;h++)
+        w->hidprobs[h] = 1.0/(1.0 + exp(-w->sumW[h] - hidbiases[h]));
+
+    // The logits of all the predicted movies, then one vsoftsig() over them
+    for(j=0;j<nq;j++) {
+        int m=userent[base0+j0+j]&USER_MOVIEMASK;
+        if ( q8opt )
+            qdotrows(w->hidprobs, m, w->recon[j]);
+        else
+            hk.dotrows(w->hidprobs, HMOV(vishid,m), w->recon[j]);
+        for(r=0;r<SOFTMAX;r++)
+            w->recon[j][r] += visbiases[m*SOFTMAX+r];
+    }
+    vsoftsig(&w->recon[0][0], nq, SOFTMAX);
+    for(j=0;j<nq;j++) {
+        double *p = w->recon[j];
+        pred[base0+j0+j] = 1.0 + p[1] + 2.0 * p[2] + 3.0 * p[3] + 4.0 * p[4];
+    }
+
+    // The probe ratings are known, so sum their error unless they were used
+    if ( !aopt )
+        for(j=useridx[u][1];j<useridx[u][1]+useridx[u][2];j++) {
+            double e = ((userent[base0+j]>>USER_LMOVIEMASK)&7) + 1.0 - pred[base0+j];
+            w->s += e*e;
+            w->n++;
+        }
+}
+
+void score_block(void *arg, int t, int nt) {
+    int *range = arg;
+    int n = range[1] - range[0];
+    int u;
+    for(u=range[0]+(n*t)/nt; u<range[0]+(n*(t+1))/nt; u++)
+        score_user(&work[t], u);
+}
+
+// Users per block, each block is split between the threads and then queued
+// for the writer
+#define SCOREBLOCK 1000
+
+int main(int argc, char **argv) {
+    char *model_path = "data/rbm.model";
+    char *out_path = NULL;
+    size_t nentries;
+    int i, t, range[2];
+    lgopen(argc,argv);
+    for(i=1;i<argc;i++) {
+        if(!strcmp(argv[i],"-m") && i+1<argc)
+            model_path=argv[++i];
+        else if(!strcmp(argv[i],"-ui") && i+1<argc)
+            useridx_path=argv[++i];
+        else if(!strcmp(argv[i],"-ue") && i+1<argc)
+            userent_path=argv[++i];
+        else if(!strcmp(argv[i],"-o") && i+1<argc)
+            out_path=argv[++i];
+        else if(!strcmp(argv[i],"-t") && i+1<argc)
+            nthreads=atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-a"))
+            aopt=1;
+        else if(!strcmp(argv[i],"-q"))
+            qopt=1;
+        else if(!strcmp(argv[i],"-q8"))
+            q8opt=1;
+        else {
+            lg("Unrecognized argument %d %s ?\n",i,argv[i]);
+            lg("-m <fname> - model file written by rbm or rbmcond -sm (data/rbm.model)\n");
+            lg("-ui <fname> - user index (data/user_index.bin)\n");
+            lg("-ue <fname> - user entries (data/user_entry.bin)\n");
+            lg("-o <fname> - write the predictions to file\n");
+            lg("-a - condition on the probe ratings as well\n");
+            lg("-q - predict only the entries not conditioned on\n");
+            lg("-q8 - use 8 bit weights\n");
+            lg("-t <n> - number of worker threads.\n");
+            exit(0);
+        }
+    }
+    if(!out_path)
+        error("No output file (-o)\n");
+    if(nthreads<1 || nthreads>MAXTHREADS)
+        error("Bad number of threads %d (-t)\n",nthreads);
+
+    load_model_file(model_path);
+    hk_setup();
+    if(q8opt)
+        quantize();
+
+    nusers = file_size(useridx_path)/sizeof(*useridx);
+    nentries = file_size(userent_path)/sizeof(*userent);
+    useridx = map_bin(useridx_path, nusers*sizeof(*useridx), 0);
+    userent = map_bin(userent_path, nentries*sizeof(*userent), 0);
+    if ( nusers && useridx[nusers-1][0]+UNTOTAL(nusers-1) != nentries )
+        error("%s does not match %s\n", useridx_path, userent_path);
+    pred = calloc(nentries, sizeof(*pred));
+    if ( !pred ) error("Cant allocate the predictions\n");
+    for(t=0;t<nthreads;t++) {
+        work[t].sumW     = malloc(hstride*sizeof(real));
+        work[t].hidprobs = calloc(hstride, sizeof(real));
+        work[t].recon    = malloc(NMOVIES*sizeof(*work[t].recon));
+    }
+
+    double wt0=wtime();
+    struct stream *out = stream_open(out_path);
+    for(range[0]=0;range[0]<nusers;range[0]+=SCOREBLOCK) {
+        range[1] = range[0]+SCOREBLOCK < nusers ? range[0]+SCOREBLOCK : nusers;
+        parallel(nthreads, score_block, range);
+        size_t e0 = useridx[range[0]][0];
+        size_t e1 = useridx[range[1]-1][0]+UNTOTAL(range[1]-1);
+        stream_write(out, &pred[e0], (e1-e0)*sizeof(*pred));
+    }
+    stream_close(out);
+    double wt=wtime()-wt0;
+    lg("Scored %d users, %lu entries in %f sec (%.0f users/sec)\n",
+        nusers, (unsigned long)nentries, wt, nusers/(wt > 0 ? wt : 1e-9));
+    if(!aopt) {
+        double s=0.;
+        int n=0;
+        for(t=0;t<nthreads;t++) {
+            s += work[t].s;
+            n += work[t].n;
+        }
+        if(n)
+            lg("Probe RMSE %f on %d ratings\n", sqrt(s/n), n);
+    }
+    return 0;
+}
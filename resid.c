@@ -0,0 +1,575 @@
+/*
+########################################################################
+#  Netflix Prize Tools
+#  Copyright (C) 2009 Greg Bildson
+#  http://code.google.com/p/nprizeadditions/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+########################################################################
+*/
+/*   resid.c
+     Compressed residual files.  A file is a struct residhead, a table of
+     nchunks struct residchunk and the chunks.  Each chunk holds RESID_CHUNK
+     entries (the last one the rest) and is decoded on its own, so the
+     chunks of a file are encoded and decoded on all the threads.
+
+     The entries are stored as half precision floats (RESID_F16) or, with
+     -zq, as 8 bit steps between the chunk's smallest and largest residual
+     (RESID_Q8).  The bytes of a chunk are grouped by their position in the
+     value (all the low bytes, then all the high bytes), which puts the
+     sign and exponent bytes next to each other.  With -zlz each chunk is
+     then LZ compressed if that makes it smaller.  That pays off for
+     residuals with long repeats (clipped or untrained entries, q8), but
+     little for a trained model's fp16 residuals, whose bytes rarely repeat
+     four at a time.
+
+     Precision: RESID_F16 rounds to nearest, so the error is at most 2^-11
+     of the residual (0.00049 for |r|<1, 0.00098 for |r|<2, 0.002 for
+     |r|<4).  RESID_Q8 errs by at most half a step, (max-min)/510 of the
+     chunk, which is 0.0157 for residuals spanning -4..4.  Use it only where
+     that does not matter.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "basic.h"
+#include "netflix.h"
+#include "utest.h"
+#include "resid.h"
+
+struct resid {
+	char *path;
+	unsigned char *base;	/* the mapped file */
+	size_t size;
+	struct residhead *h;
+	struct residchunk *c;
+};
+
+/* FNV-1a */
+static unsigned int checksum(unsigned int s, void *data, size_t len)
+{
+	unsigned char *p=data;
+	size_t i;
+	for(i=0;i<len;i++)
+		s=(s^p[i])*16777619u;
+	return s;
+}
+#define CHECKSUM0 2166136261u
+
+/* IEEE half precision, rounded to nearest even */
+static unsigned short f2h(float f)
+{
+	unsigned int x,m,h,rem;
+	int e;
+	memcpy(&x,&f,4);
+	unsigned int sign=(x>>16)&0x8000;
+	m=x&0x7fffff;
+	if(((x>>23)&0xff)==0xff)
+		return sign|0x7c00|(m?0x200:0);
+	e=(int)((x>>23)&0xff)-127+15;
+	if(e>=31)
+		return sign|0x7c00;
+	if(e<=0) {
+		if(e<-10) return sign;
+		int shift=14-e;
+		m|=0x800000;
+		h=m>>shift;
+		rem=m&((1u<<shift)-1);
+		if(rem>(1u<<(shift-1)) || (rem==(1u<<(shift-1)) && (h&1))) h++;
+		return sign|h;
+	}
+	h=(e<<10)|(m>>13);
+	rem=m&0x1fff;
+	if(rem>0x1000 || (rem==0x1000 && (h&1))) h++;
+	return sign|h;
+}
+
+static float h2f(unsigned short h)
+{
+	unsigned int sign=(h&0x8000)<<16;
+	unsigned int e=(h>>10)&31;
+	unsigned int m=h&0x3ff;
+	unsigned int x;
+	float f;
+	if(e==31)
+		x=sign|0x7f800000|(m<<13);
+	else if(e)
+		x=sign|((e-15+127)<<23)|(m<<13);
+	else if(m) {
+		e=127-15+1;
+		while(!(m&0x400)) {
+			m<<=1;
+			e--;
+		}
+		x=sign|(e<<23)|((m&0x3ff)<<13);
+	} else
+		x=sign;
+	memcpy(&f,&x,4);
+	return f;
+}
+
+/* LZ77 in the layout of an LZ4 block: each sequence is a token byte (the
+   number of literals <<4 | the match length-4), the literals, a 2 byte
+   offset back into the output and the match.  A count of 15 in the token
+   goes on in bytes that are added while they are 255.  The last sequence
+   is only literals. */
+#define LZ_HASH	(13)
+
+static int lz_put(unsigned char *dst, int *o, int cap, unsigned char *lit, int nlit, int off, int mlen)
+{
+	unsigned char *p=dst+*o;
+	int ml=mlen ? mlen-4 : 0;
+	int v;
+	if(*o+nlit+nlit/255+ml/255+8>cap) return 1;
+	*p++=((nlit<15 ? nlit : 15)<<4)|(ml<15 ? ml : 15);
+	if(nlit>=15) {
+		for(v=nlit-15;v>=255;v-=255) *p++=255;
+		*p++=v;
+	}
+	memcpy(p,lit,nlit);
+	p+=nlit;
+	if(mlen) {
+		*p++=off&0xff;
+		*p++=off>>8;
+		if(ml>=15) {
+			for(v=ml-15;v>=255;v-=255) *p++=255;
+			*p++=v;
+		}
+	}
+	*o=p-dst;
+	return 0;
+}
+
+/* Returns the compressed length, or -1 if it would not fit in cap */
+static int lz_compress(unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	int *table=malloc(sizeof(int)<<LZ_HASH);
+	int i=0,anchor=0,o=0;
+	if(!table) error("Cant allocate LZ table\n");
+	memset(table,-1,sizeof(int)<<LZ_HASH);
+	while(i+4<=n) {
+		unsigned int x;
+		memcpy(&x,src+i,4);
+		int hh=(x*2654435761u)>>(32-LZ_HASH);
+		int ref=table[hh];
+		table[hh]=i;
+		if(ref<0 || i-ref>65535 || memcmp(src+ref,src+i,4)) {
+			i++;
+			continue;
+		}
+		int len=4;
+		while(i+len<n && src[ref+len]==src[i+len]) len++;
+		if(lz_put(dst,&o,cap,src+anchor,i-anchor,i-ref,len)) {
+			free(table);
+			return -1;
+		}
+		i+=len;
+		anchor=i;
+	}
+	free(table);
+	if(lz_put(dst,&o,cap,src+anchor,n-anchor,0,0)) return -1;
+	return o;
+}
+
+/* Returns the decompressed length, or -1 if src is not a valid block */
+static int lz_decompress(unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	unsigned char *ip=src,*end=src+n;
+	int o=0,b,k;
+	while(ip<end) {
+		int tok=*ip++;
+		int nlit=tok>>4;
+		int mlen=(tok&15)+4;
+		if(nlit==15)
+			do {
+				if(ip>=end) return -1;
+				b=*ip++;
+				nlit+=b;
+			} while(b==255);
+		if(nlit>end-ip || nlit>cap-o) return -1;
+		memcpy(dst+o,ip,nlit);
+		ip+=nlit;
+		o+=nlit;
+		if(ip==end) break;
+		if(end-ip<2) return -1;
+		int off=ip[0]|(ip[1]<<8);
+		ip+=2;
+		if((tok&15)==15)
+			do {
+				if(ip>=end) return -1;
+				b=*ip++;
+				mlen+=b;
+			} while(b==255);
+		if(off==0 || off>o || mlen>cap-o) return -1;
+		for(k=0;k<mlen;k++,o++)
+			dst[o]=dst[o-off];
+	}
+	return o;
+}
+
+/* Bytes per entry of an encoding */
+static int resid_width(int encoding)
+{
+	return encoding==RESID_Q8 ? 1 : 2;
+}
+
+/* Encode n entries into out (room for width*n bytes), byte planes first */
+static void encode(float *data, int n, int encoding, unsigned char *out, struct residchunk *c)
+{
+	int i;
+	if(encoding==RESID_Q8) {
+		float lo=data[0],hi=data[0];
+		for(i=1;i<n;i++) {
+			if(data[i]<lo) lo=data[i];
+			if(data[i]>hi) hi=data[i];
+		}
+		c->lo=lo;
+		c->step=(hi-lo)/255.;
+		for(i=0;i<n;i++) {
+			long q=c->step>0. ? lrintf((data[i]-lo)/c->step) : 0;
+			out[i]=q>255 ? 255 : q;
+		}
+	} else {
+		for(i=0;i<n;i++) {
+			unsigned short h=f2h(data[i]);
+			out[i]=h&0xff;
+			out[n+i]=h>>8;
+		}
+	}
+}
+
+static void decode(unsigned char *in, int n, int encoding, struct residchunk *c, float *out)
+{
+	int i;
+	if(encoding==RESID_Q8) {
+		for(i=0;i<n;i++)
+			out[i]=c->lo+in[i]*c->step;
+	} else {
+		for(i=0;i<n;i++)
+			out[i]=h2f(in[i]|(in[n+i]<<8));
+	}
+}
+
+/* Entries in chunk k of a file of n entries */
+#define CHUNKLEN(k,n)	((k+1)*(size_t)RESID_CHUNK<=(n) ? RESID_CHUNK : (n)-(k)*RESID_CHUNK)
+
+/* The chunks are encoded by all the threads, chunk k on thread k%nt */
+struct residjob {
+	float *data;
+	int n;
+	int encoding;
+	int lz;
+	struct residchunk *c;
+	unsigned char **out;
+	struct resid *r;
+	float *dst;
+};
+
+static void encode_chunks(void *arg, int t, int nt)
+{
+	struct residjob *j=arg;
+	int w=resid_width(j->encoding);
+	int nchunks=(j->n+RESID_CHUNK-1)/RESID_CHUNK;
+	unsigned char *raw=malloc(w*RESID_CHUNK);
+	int k;
+	if(!raw) error("Cant allocate chunk\n");
+	for(k=t;k<nchunks;k+=nt) {
+		int n=CHUNKLEN(k,j->n);
+		struct residchunk *c=&j->c[k];
+		unsigned char *o=malloc(w*n);
+		if(!o) error("Cant allocate chunk\n");
+		encode(j->data+(size_t)k*RESID_CHUNK,n,j->encoding,raw,c);
+		int len=j->lz ? lz_compress(raw,w*n,o,w*n) : -1;
+		if(len>0 && len<w*n) {
+			c->flags=RESID_LZ;
+			c->len=len;
+		} else {
+			c->flags=0;
+			c->len=w*n;
+			memcpy(o,raw,w*n);
+		}
+		c->checksum=checksum(CHECKSUM0,o,c->len);
+		j->out[k]=o;
+	}
+	free(raw);
+}
+
+/* Write n residuals to path as a compressed residual file, trying LZ on
+   each chunk if lz is set */
+void resid_write(char *path, char *model, float *data, int n, int encoding, int lz)
+{
+	struct residhead h;
+	struct residjob j;
+	char tmp[1024];
+	FILE *fp;
+	int k,u;
+	lg("Writing %s\n",path);
+	memset(&h,0,sizeof(h));
+	h.magic=RESID_MAGIC;
+	h.version=RESID_VERSION;
+	strncpy(h.model,model,sizeof(h.model)-1);
+	h.nentries=n;
+	h.counts[0]=NUSERS;
+	for(u=0;u<NUSERS;u++)
+		for(k=1;k<4;k++)
+			h.counts[k]+=useridx[u][k];
+	h.chunk=RESID_CHUNK;
+	h.nchunks=(n+RESID_CHUNK-1)/RESID_CHUNK;
+	h.encoding=encoding;
+
+	j.data=data;
+	j.n=n;
+	j.encoding=encoding;
+	j.lz=lz;
+	j.c=calloc(h.nchunks,sizeof(*j.c));
+	j.out=calloc(h.nchunks,sizeof(*j.out));
+	if(!j.c || !j.out) error("Cant allocate chunk table\n");
+	parallel(nthreads,encode_chunks,&j);
+
+	uint64_t offset=sizeof(h)+h.nchunks*sizeof(*j.c);
+	for(k=0;k<h.nchunks;k++) {
+		j.c[k].offset=offset;
+		offset+=j.c[k].len;
+	}
+	h.checksum=checksum(checksum(CHECKSUM0,&h,sizeof(h)),j.c,h.nchunks*sizeof(*j.c));
+
+	snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+	fp=fopen(tmp,"wb");
+	if(!fp) error("Cant open %s\n",tmp);
+	if(fwrite(&h,sizeof(h),1,fp)!=1 || fwrite(j.c,sizeof(*j.c),h.nchunks,fp)!=h.nchunks)
+		error("Failed to write %s\n",tmp);
+	for(k=0;k<h.nchunks;k++) {
+		if(fwrite(j.out[k],1,j.c[k].len,fp)!=j.c[k].len)
+			error("Failed to write %s\n",tmp);
+		free(j.out[k]);
+	}
+	if(fclose(fp)) error("Failed to write %s\n",tmp);
+	if(rename(tmp,path)) error("Failed to rename %s\n",tmp);
+	lg("%u entries in %lu bytes (%.2f bytes/entry)\n",n,(unsigned long)offset,offset/(double)n);
+	free(j.c);
+	free(j.out);
+}
+
+/* Map path if it is a compressed residual file, NULL if it is not one */
+struct resid *resid_open(char *path)
+{
+	struct residhead h;
+	struct stat st;
+	struct resid *r;
+	FILE *fp=fopen(path,"rb");
+	int k;
+	if(!fp) error("Cant open %s\n",path);
+	if(fread(&h,sizeof(h),1,fp)!=1 || h.magic!=RESID_MAGIC) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	if(h.version!=RESID_VERSION)
+		error("%s is version %u, expected %u\n",path,h.version,RESID_VERSION);
+	if(h.chunk!=RESID_CHUNK || h.nchunks!=(h.nentries+RESID_CHUNK-1)/RESID_CHUNK)
+		error("%s has a bad chunk table\n",path);
+	if(stat(path,&st)) error("Cant open %s\n",path);
+
+	r=calloc(1,sizeof(*r));
+	r->path=path;
+	r->size=st.st_size;
+	r->base=map_bin(path,r->size,0);
+	r->h=(struct residhead *)r->base;
+	r->c=(struct residchunk *)(r->base+sizeof(h));
+	h.checksum=0;
+	if(sizeof(h)+h.nchunks*sizeof(*r->c)>r->size ||
+	   checksum(checksum(CHECKSUM0,&h,sizeof(h)),r->c,h.nchunks*sizeof(*r->c))!=r->h->checksum)
+		error("%s: header checksum does not match\n",path);
+	for(k=0;k<h.nchunks;k++)
+		if(r->c[k].offset+r->c[k].len>r->size)
+			error("%s: chunk %d is past the end of the file\n",path,k);
+	lg("%s: %s residuals, %u entries, %s\n",path,r->h->model,h.nentries,
+		h.encoding==RESID_Q8 ? "8 bit" : "half precision");
+	return r;
+}
+
+int resid_entries(struct resid *r)
+{
+	return r->h->nentries;
+}
+
+static void decode_chunks(void *arg, int t, int nt)
+{
+	struct residjob *j=arg;
+	struct resid *r=j->r;
+	int w=resid_width(r->h->encoding);
+	unsigned char *raw=malloc(w*RESID_CHUNK);
+	int k;
+	if(!raw) error("Cant allocate chunk\n");
+	for(k=t;k<r->h->nchunks;k+=nt) {
+		struct residchunk *c=&r->c[k];
+		int n=CHUNKLEN(k,r->h->nentries);
+		unsigned char *p=r->base+c->offset;
+		if(checksum(CHECKSUM0,p,c->len)!=c->checksum)
+			error("%s: chunk %d checksum does not match\n",r->path,k);
+		if(c->flags&RESID_LZ) {
+			if(lz_decompress(p,c->len,raw,w*n)!=w*n)
+				error("%s: chunk %d is corrupt\n",r->path,k);
+			p=raw;
+		} else if(c->len!=w*n)
+			error("%s: chunk %d has the wrong length\n",r->path,k);
+		decode(p,n,r->h->encoding,c,j->dst+(size_t)k*RESID_CHUNK);
+	}
+	free(raw);
+}
+
+/* All the entries of r, decoded on all the threads */
+void resid_decode(struct resid *r, float *out)
+{
+	struct residjob j;
+	j.r=r;
+	j.dst=out;
+	parallel(nthreads,decode_chunks,&j);
+}
+
+void resid_close(struct resid *r)
+{
+	unmap_bin(r->base,r->size);
+	free(r);
+}
+
+/* Write the probe and qualify entries of the NENTRIES residuals in data to
+   path, about 4% of a full file */
+void resid_write_pq(char *path, char *model, float *data)
+{
+	struct residpq h;
+	unsigned int *start=malloc((NUSERS+1)*sizeof(*start));
+	char tmp[1024];
+	FILE *fp;
+	int u;
+	if(!start) error("Cant allocate index\n");
+	lg("Writing %s\n",path);
+	memset(&h,0,sizeof(h));
+	h.magic=RESIDPQ_MAGIC;
+	h.version=RESIDPQ_VERSION;
+	strncpy(h.model,model,sizeof(h.model)-1);
+	h.nusers=NUSERS;
+	for(u=0;u<NUSERS;u++) {
+		start[u]=h.nentries;
+		h.nentries+=useridx[u][2]+useridx[u][3];
+		h.nprobe+=useridx[u][2];
+		h.nqualify+=useridx[u][3];
+	}
+	start[NUSERS]=h.nentries;
+	h.checksum=checksum(CHECKSUM0,start,(NUSERS+1)*sizeof(*start));
+	for(u=0;u<NUSERS;u++)
+		h.checksum=checksum(h.checksum,&data[useridx[u][0]+useridx[u][1]],(start[u+1]-start[u])*sizeof(float));
+
+	snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+	fp=fopen(tmp,"wb");
+	if(!fp) error("Cant open %s\n",tmp);
+	if(fwrite(&h,sizeof(h),1,fp)!=1 || fwrite(start,sizeof(*start),NUSERS+1,fp)!=NUSERS+1)
+		error("Failed to write %s\n",tmp);
+	for(u=0;u<NUSERS;u++)
+		if(fwrite(&data[useridx[u][0]+useridx[u][1]],sizeof(float),start[u+1]-start[u],fp)!=start[u+1]-start[u])
+			error("Failed to write %s\n",tmp);
+	if(fclose(fp)) error("Failed to write %s\n",tmp);
+	if(rename(tmp,path)) error("Failed to rename %s\n",tmp);
+	lg("%u probe and %u qualify entries\n",h.nprobe,h.nqualify);
+	free(start);
+}
+
+/* Read a -sepq file into e, NULL if path is not one.  The train entries it
+   does not have are set to rating-1, as err is when there is no -le file,
+   so they are no residuals to train on: with needtrain set such a file is
+   an error, otherwise only the probe and qualify results of the run mean
+   anything. */
+static float *load_pq(char *path, int needtrain)
+{
+	struct residpq h;
+	struct stat st;
+	unsigned char *p;
+	unsigned int *start;
+	float *data,*e;
+	int u,i;
+	FILE *fp=fopen(path,"rb");
+	if(!fp) error("Cant open %s\n",path);
+	if(fread(&h,sizeof(h),1,fp)!=1 || h.magic!=RESIDPQ_MAGIC) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	if(h.version!=RESIDPQ_VERSION)
+		error("%s is version %u, expected %u\n",path,h.version,RESIDPQ_VERSION);
+	if(h.nusers!=NUSERS) error("%s has %u users, expected %d\n",path,h.nusers,NUSERS);
+	if(stat(path,&st)) error("Cant open %s\n",path);
+	size_t len=sizeof(h)+(NUSERS+1)*sizeof(*start)+(size_t)h.nentries*sizeof(float);
+	if(st.st_size!=len) error("%s is %lu bytes, expected %lu\n",path,(unsigned long)st.st_size,(unsigned long)len);
+	p=map_bin(path,len,0);
+	start=(unsigned int *)(p+sizeof(h));
+	data=(float *)(start+NUSERS+1);
+	if(checksum(checksum(CHECKSUM0,start,(NUSERS+1)*sizeof(*start)),data,(size_t)h.nentries*sizeof(float))!=h.checksum)
+		error("%s: checksum does not match\n",path);
+	lg("%s: %s probe and qualify residuals\n",path,h.model);
+	if(needtrain)
+		error("%s has only probe and qualify residuals, use it to blend or with -l 0\n",path);
+
+	e=malloc(NENTRIES*sizeof(float));
+	if(!e) error("Cant allocate residuals\n");
+	for(u=0;u<NUSERS;u++) {
+		int base=useridx[u][0];
+		int d0=useridx[u][1];
+		if(start[u+1]-start[u]!=useridx[u][2]+useridx[u][3])
+			error("%s does not match the user index at user %d\n",path,u);
+		for(i=0;i<d0;i++)
+			e[base+i]=(userent[base+i]>>USER_LMOVIEMASK)&7;
+		memcpy(&e[base+d0],&data[start[u]],(start[u+1]-start[u])*sizeof(float));
+	}
+	unmap_bin(p,len);
+	return e;
+}
+
+/* The NENTRIES residuals of a -le file, raw, compressed or probe and
+   qualify only (an error if the run needs the train residuals).  A raw
+   file is mapped (copy-on-write with cow set) and *mapped set, the others
+   are decoded into memory from malloc(). */
+float *load_err(char *path, int cow, int needtrain, int *mapped)
+{
+	struct resid *r=resid_open(path);
+	unsigned int counts[4];
+	float *e;
+	int u,k;
+	if(!r) {
+		e=load_pq(path,needtrain);
+		*mapped=!e;
+		return e ? e : map_bin(path,NENTRIES*sizeof(float),cow);
+	}
+	if(resid_entries(r)!=NENTRIES)
+		error("%s has %d entries, expected %d\n",path,resid_entries(r),NENTRIES);
+	// The same total can be split differently between train, probe and
+	// qualify by another user index, which would decode to the wrong entries
+	memset(counts,0,sizeof(counts));
+	counts[0]=NUSERS;
+	for(u=0;u<NUSERS;u++)
+		for(k=1;k<4;k++)
+			counts[k]+=useridx[u][k];
+	if(memcmp(counts,r->h->counts,sizeof(counts)))
+		error("%s has %u users and %u/%u/%u train/probe/qualify entries, expected %u and %u/%u/%u\n",
+			path,r->h->counts[0],r->h->counts[1],r->h->counts[2],r->h->counts[3],
+			counts[0],counts[1],counts[2],counts[3]);
+	e=malloc(NENTRIES*sizeof(float));
+	if(!e) error("Cant allocate residuals\n");
+	resid_decode(r,e);
+	resid_close(r);
+	*mapped=0;
+	return e;
+}
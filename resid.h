@@ -0,0 +1,77 @@
+/*
+########################################################################
+#  Netflix Prize Tools
+#  Copyright (C) 2009 Greg Bildson
+#  http://code.google.com/p/nprizeadditions/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+########################################################################
+*/
+/*   resid.h
+     Compressed residual files (-sez), read wherever a raw -le file is
+     accepted.  See resid.c for the layout.
+*/
+#define RESID_MAGIC	0x44535252	/* "RRSD" */
+#define RESID_VERSION	1
+#define RESID_CHUNK	(65536)		/* entries per chunk */
+
+/* Encodings of the residuals */
+#define RESID_F16	1	/* IEEE half precision */
+#define RESID_Q8	2	/* 8 bits between the chunk's min and max */
+
+/* Chunk flags */
+#define RESID_LZ	1	/* stored LZ compressed */
+
+struct residhead {
+	unsigned int magic, version;
+	char model[16];
+	unsigned int nentries;
+	unsigned int counts[4];		/* users, train, probe and qualify entries */
+	unsigned int chunk, nchunks;
+	unsigned int encoding;
+	unsigned int checksum;		/* of the header (with this 0) and chunk table */
+};
+
+struct residchunk {
+	uint64_t offset;		/* of the stored bytes in the file */
+	unsigned int len;		/* stored bytes */
+	unsigned int flags;
+	float lo, step;			/* RESID_Q8: value q is lo+q*step */
+	unsigned int checksum;		/* of the stored bytes */
+	unsigned int pad;
+};
+
+/* Probe and qualify residuals only (-sepq): a struct residpq, the index
+   start[NUSERS+1] of each user's entries and the entries, the probe and
+   then the qualify residuals of each user in userent order */
+#define RESIDPQ_MAGIC	0x51505252	/* "RRPQ" */
+#define RESIDPQ_VERSION	1
+
+struct residpq {
+	unsigned int magic, version;
+	char model[16];
+	unsigned int nusers, nentries;
+	unsigned int nprobe, nqualify;
+	unsigned int checksum;		/* of the index and entries */
+	unsigned int pad;
+};
+
+struct resid;
+struct resid *resid_open(char *path);
+int resid_entries(struct resid *r);
+void resid_decode(struct resid *r, float *out);
+void resid_close(struct resid *r);
+void resid_write(char *path, char *model, float *data, int n, int encoding, int lz);
+void resid_write_pq(char *path, char *model, float *data);
+float *load_err(char *path, int cow, int needtrain, int *mapped);
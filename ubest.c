@@ -34,7 +34,16 @@
 #include "netflix.h"
 #include "utest.h"
 #include "weight.h"
-int score_argv(char **argv) {return 0;}
+int cmpopt=0;
+
+// -cmp also runs the serial trainer first and reports both convergence curves
+int score_argv(char **argv) {
+	if(!strcmp(argv[0],"-cmp")) {
+		cmpopt=1;
+		return 1;
+	}
+	return 0;
+}
 
 #define GLOBAL_MEAN (3.603304)
 float wbU[NUSERS]; 
@@ -74,7 +83,110 @@ int score_train(int loop) {
 	return 1;
 }
 
-int doAllFeatures() {
+// One SGD pass over the training ratings of a contiguous share of the users.
+// With more than one thread this is Hogwild: every thread owns the wbU of its
+// users, while wbV is shared and updated without locks.  The relaxed atomic
+// loads and stores compile to plain moves; an update that races with another
+// thread's may be lost, which SGD tolerates.
+void train_users(void *arg, int t, int nt) {
+	float Gamma0=*(float *)arg;
+	int u,j;
+	double pc;
+	PH_START(&pc,t);
+	for(u=(NUSERS*t)/nt;u<(NUSERS*(t+1))/nt;u++) {
+
+		int d0 = UNTRAIN(u);
+		int base0=useridx[u][0];
+
+		// For all rated movies
+		for(j=0;j<d0;j++) {
+			int m=userent[base0+j]&USER_MOVIEMASK;
+
+			// Figure out the current error
+		    int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
+		    r++;
+			float wbVm;
+			__atomic_load(&wbV[m],&wbVm,__ATOMIC_RELAXED);
+			float e2;
+			e2 = r - (GLOBAL_MEAN + wbU[u] + wbVm);
+
+			// Train the biases
+			float wbUu = wbU[u];
+			wbU[u] += Gamma0 * (e2 - wbUu * L4);
+			wbVm += Gamma0 * (e2 - wbVm * L4);
+			__atomic_store(&wbV[m],&wbVm,__ATOMIC_RELAXED);
+		}
+	}
+	PH_LAP(&pc,t,PH_UPDATE);
+}
+
+// Squared error sums over the training and probe ratings, per thread
+struct errsum {
+	float nrmse, s;
+	int ntrain, n;
+} errsums[MAXTHREADS];
+
+void eval_users(void *arg, int t, int nt) {
+	struct errsum *es=&errsums[t];
+	int u,i;
+	int k=2;
+	double pc;
+	PH_START(&pc,t);
+	es->nrmse=0.;
+	es->s=0.;
+	es->ntrain=0;
+	es->n=0;
+	for(u=(NUSERS*t)/nt;u<(NUSERS*(t+1))/nt;u++) {
+
+		int base0=useridx[u][0];
+		int d0 = UNTRAIN(u);
+
+		for(i=0; i<d0;i++) {
+			int m=userent[base0+i]&USER_MOVIEMASK;
+
+		    int r=(userent[base0+i]>>USER_LMOVIEMASK)&7;
+		    r++;
+			float e2;
+			e2 = r - (GLOBAL_MEAN + wbU[u] + wbV[m]);
+
+			es->nrmse+=e2*e2;
+			es->ntrain++;
+		}
+
+
+		// Attempt to compute probe RMSE
+		int base=useridx[u][0];
+		for(i=1;i<k;i++) base+=useridx[u][i];
+		int d=useridx[u][k];
+		for(i=0; i<d;i++) {
+			int m=userent[base+i]&USER_MOVIEMASK;
+
+			float e;
+		    int r=(userent[base+i]>>USER_LMOVIEMASK)&7;
+		    r++;
+			e = r - (GLOBAL_MEAN + wbU[u] + wbV[m]);
+
+			es->s+=e*e;
+		}
+		es->n+=d;
+	}
+	PH_LAP(&pc,t,PH_RMSE);
+}
+
+// Probe RMSE and cumulative wall clock seconds after each epoch, for -cmp
+#define MAXEPOCHS (100)
+struct curve {
+	int nepochs;
+	double wall[MAXEPOCHS];
+	float prmse[MAXEPOCHS];
+};
+
+float swbU[NUSERS]; 
+float swbV[NMOVIES];
+
+// Train the biases from scratch on nt threads, leaving the best ones in wbU
+// and wbV.  Returns the number of epochs.
+int train_biases(int nt, struct curve *c) {
 
 	/* Initial biases */
 	{
@@ -88,22 +200,21 @@ int doAllFeatures() {
 		}
 	}
 	
-    float swbU[NUSERS]; 
-    float swbV[NMOVIES];
-	
 	/* Optimize current feature */
 	float nrmse=2., last_rmse=10.;
 	float prmse = 0, last_prmse=0;
 	int loopcount=0;
 	float Gamma0 = G0;
-	while( ( (prmse<=last_prmse) || loopcount < 6) ) {
+	double wt0=wtime();
+	lg("Training biases on %d thread%s\n",nt,nt>1?"s (Hogwild)":"");
+	while( maxepochs ? loopcount<maxepochs : ( (prmse<=last_prmse) || loopcount < 6) ) {
 		last_rmse=nrmse;
 		last_prmse=prmse;
 		nrmse=0.;
 		clock_t t0=clock();
 	    loopcount++;
 
-		int u,m,j;
+		int u,m,t;
 
 		// Save the prior wbU and wbV for when the RMSE gets worse
 		for(u=0;u<NUSERS;u++) {
@@ -114,90 +225,32 @@ int doAllFeatures() {
 		}
 
 		// Train
-		for(u=0;u<NUSERS;u++) {
-
-			//if (u%10000 == 0) {
-				//printf("On user: %d\n", u);
-				//fflush(stdout);
-			//}
-
-			int d0 = UNTRAIN(u);
-			int base0=useridx[u][0];
-
-			// For all rated movies
-			for(j=0;j<d0;j++) {
-				int m=userent[base0+j]&USER_MOVIEMASK;
-
-				// Figure out the current error
-			    int r=(userent[base0+j]>>USER_LMOVIEMASK)&7;
-			    r++;
-				//float ee=err[base0+j];
-				//float e2 = ee;
-				float e2;
-				e2 = r - (GLOBAL_MEAN + wbU[u] + wbV[m]);
-
-				// Train the biases
-				float wbUu = wbU[u];
-				float wbVm = wbV[m];
-				wbU[u] += Gamma0 * (e2 - wbUu * L4);
-				wbV[m] += Gamma0 * (e2 - wbVm * L4);
-			}
-		}
+		parallel(nt,train_users,&Gamma0);
 
 		// Report rmse for main loop
+		parallel(nt,eval_users,NULL);
 		nrmse=0.;
 		int ntrain=0;
-		int elcnt=0;
-		int k=2;
 		int n=0;
 		float s=0.;
-		int i;
-		for(u=0;u<NUSERS;u++) {
-
-			int base0=useridx[u][0];
-			int d012=UNALL(u);
-			int i;
-			int dall=UNALL(u);
-			int d0 = UNTRAIN(u);
-
-			for(i=0; i<d0;i++) {
-				int m=userent[base0+i]&USER_MOVIEMASK;
-
-			    int r=(userent[base0+i]>>USER_LMOVIEMASK)&7;
-			    r++;
-				//float ee=err[base0+j];
-				float e2;
-				e2 = r - (GLOBAL_MEAN + wbU[u] + wbV[m]);
-
-				nrmse+=e2*e2;
-				ntrain++;
-			}
-
-
-			// Attempt to compute probe RMSE
-			int base=useridx[u][0];
-			for(i=1;i<k;i++) base+=useridx[u][i];
-			int d=useridx[u][k];
-			int boffset = base-base0;
-			for(i=0; i<d;i++) {
-				int m=userent[base+i]&USER_MOVIEMASK;
-
-				//float ee = err[base+i];
-				float e;
-			    int r=(userent[base+i]>>USER_LMOVIEMASK)&7;
-			    r++;
-				e = r - (GLOBAL_MEAN + wbU[u] + wbV[m]);
-
-				s+=e*e;
-			}
-			n+=d;
+		for(t=0;t<nt;t++) {
+			nrmse+=errsums[t].nrmse;
+			ntrain+=errsums[t].ntrain;
+			s+=errsums[t].s;
+			n+=errsums[t].n;
 		}
 
 		nrmse=sqrt(nrmse/ntrain);
 		prmse = sqrt(s/n);
 		
-		lg("%f\t%f\t%f\n",nrmse,prmse,(clock()-t0)/(double)CLOCKS_PER_SEC);
+		lg("%f\t%f\t%f\t%f\n",nrmse,prmse,(clock()-t0)/(double)CLOCKS_PER_SEC,wtime()-wt0);
+		if(c && loopcount<=MAXEPOCHS) {
+			c->wall[loopcount-1]=wtime()-wt0;
+			c->prmse[loopcount-1]=prmse;
+			c->nepochs=loopcount;
+		}
 
+		prof_report("ubest",loopcount);
 		Gamma0 *= 0.90;
 	}
 
@@ -209,9 +262,33 @@ int doAllFeatures() {
 	for(m=0;m<NMOVIES;m++) {
 		wbV[m] = swbV[m];
 	}
+	return loopcount;
+}
+
+int doAllFeatures() {
+	if(cmpopt) {
+		// Convergence against wall clock time, serial then threaded
+		static struct curve c1, cn;
+		int i;
+		train_biases(1,&c1);
+		train_biases(nthreads,&cn);
+		lg("epoch\tserial sec\tserial probe\t%d threads sec\t%d threads probe\n",nthreads,nthreads);
+		for(i=0;i<c1.nepochs || i<cn.nepochs;i++) {
+			lg("%d",i+1);
+			if(i<c1.nepochs) lg("\t%f\t%f",c1.wall[i],c1.prmse[i]);
+			else lg("\t\t");
+			if(i<cn.nepochs) lg("\t%f\t%f",cn.wall[i],cn.prmse[i]);
+			lg("\n");
+		}
+	} else
+		train_biases(nthreads,NULL);
 	
 	/* Perform a final iteration in which the errors are clipped and stored */
+	double pc;
+	PH_START(&pc,0);
 	removeUV();
+	PH_LAP(&pc,0,PH_RMSE);
+	prof_report("ubest",0);
 	
 	return 1;
 }
@@ -27,22 +27,32 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/resource.h>
 #include "basic.h"
 #include "netflix.h"
 #include "utest.h"
+#include "resid.h"
 
 int aopt=0;
 int load_model=0;
 int save_model=0;
 int dontclip=0;
+int copt=1;
+int nthreads=1;
+int maxepochs=0;	// -epochs, 0 leaves it to the model
 char *fname_outerr=NULL;
 char *useridx_path="data/user_index.bin";
 char *userent_path="data/user_entry.bin";
 char *fname_rmovie=NULL;
 
-int useridx[NUSERS][4];
-unsigned int userent[NENTRIES];
-float err[NENTRIES];
+// The data files are mapped (map_bin), err is private to the process
+int (*useridx)[4];
+unsigned int *userent;
+float *err;
+
+struct stream *errstream=NULL;
+int errnext=0;	// entries of err already streamed to fname_outerr
 
 void clip(float *ein, unsigned int *uent, float *eout, int d)
 {
@@ -68,6 +78,25 @@ void cliperr()
 	}
 }
 
+// Models that finish the residuals one block of users at a time (recordErrors
+// in rbm and rbmcond) pass each block, in user order, to err_stream().  The -se
+// file is then written by a background thread while the rest of the pass
+// runs, instead of all at once at the end.
+void err_stream(int u0, int u1)
+{
+	int u;
+	if(!fname_outerr || u0>=u1) return;
+	if(!errstream) errstream=stream_open(fname_outerr);
+	int base=useridx[u0][0];
+	int end=useridx[u1-1][0]+UNTOTAL(u1-1);
+	if(base!=errnext) error("Residuals of user %d streamed out of order\n",u0);
+	if(copt) // as cliperr() will do after the loop
+		for(u=u0;u<u1;u++)
+			clip(&err[useridx[u][0]],&userent[useridx[u][0]],&err[useridx[u][0]],UNTOTAL(u));
+	stream_write(errstream,&err[base],(end-base)*sizeof(*err));
+	errnext=end;
+}
+
 double cliprmse(int k)
 {
 	int u;
@@ -156,15 +185,131 @@ void rmse_print(int copt)
 	last_rmse_train=rmse_train;
 }
 
+// The entry of every user of qualify.bin, in file order.  The qualify entries
+// of all users are sorted by movie into lists in user order, and each
+// (movie,user) of the file is found by a binary search in its movie's list.
+int *qualify_index(unsigned int *qualify)
+{
+	int *mstart=calloc(NMOVIES+1,sizeof(int));
+	int *users=malloc(NQUALIFY_SIZE*sizeof(int));
+	int *ents=malloc(NQUALIFY_SIZE*sizeof(int));
+	int *index=malloc(NQUALIFY_SIZE*sizeof(int));
+	int u,k,m,n=0;
+	if(!mstart || !users || !ents || !index) error("Cant allocate qualify index\n");
+	for(u=0;u<NUSERS;u++) {
+		int base2=useridx[u][0]+useridx[u][1]+useridx[u][2];
+		for(k=0;k<useridx[u][3];k++)
+			mstart[(userent[base2+k]&USER_MOVIEMASK)+1]++;
+		n+=useridx[u][3];
+	}
+	if(n>NQUALIFY_SIZE) error("%d qualify entries\n",n);
+	for(m=0;m<NMOVIES;m++)
+		mstart[m+1]+=mstart[m];
+	for(u=0;u<NUSERS;u++) {
+		int base2=useridx[u][0]+useridx[u][1]+useridx[u][2];
+		for(k=0;k<useridx[u][3];k++) {
+			m=userent[base2+k]&USER_MOVIEMASK;
+			users[mstart[m]]=u;
+			ents[mstart[m]++]=base2+k;
+		}
+	}
+	for(m=NMOVIES;m>0;m--)
+		mstart[m]=mstart[m-1];
+	mstart[0]=0;
+
+	unsigned int *q=qualify;
+	int i=0;
+	while (q<(qualify+NQUALIFY_SIZE)) {
+		m=*q++;
+		int l=*q++;
+		int j;
+		for(j=0;j<l;j++) {
+			u=*q++;
+			int lo=mstart[m],hi=mstart[m+1];
+			while(lo<hi) {
+				int mid=(lo+hi)/2;
+				if(users[mid]<u) lo=mid+1;
+				else hi=mid;
+			}
+			if(lo==mstart[m+1] || users[lo]!=u) error("Bad qualify %d %d\n",m,u);
+			index[i++]=ents[lo];
+		}
+	}
+	free(mstart);
+	free(users);
+	free(ents);
+	return index;
+}
+
+// Append "%.1f\n" of v to p.  v is 8 minus a float, so v*10 is exact and
+// rounding it to even gives the same digits as printf.
+static char *put_rating(char *p, double v)
+{
+	double x=v*10.;
+	if(signbit(x)) {
+		*p++='-';
+		x=-x;
+	}
+	long n=(long)nearbyint(x);
+	p+=sprintf(p,"%ld",n/10);
+	*p++='.';
+	*p++='0'+n%10;
+	*p++='\n';
+	return p;
+}
+
+// Write the qualifying submission, formatted a buffer at a time
+#define QBUF (1<<20)
+void write_qualify(char *path)
+{
+	double wt0=wtime();
+	char *qualify_path="data/qualify.bin";
+	unsigned int *qualify=malloc(NQUALIFY_SIZE*4);
+	char *buf=malloc(QBUF+64);
+	if(!qualify || !buf) error("Cant allocate qualify\n");
+	load_bin(qualify_path,qualify,NQUALIFY_SIZE*4);
+	int *index=qualify_index(qualify);
+	FILE *fp=fopen(path,"w");
+	if(!fp) error("Cant open %s\n",path);
+	char *p=buf;
+	unsigned int *q=qualify;
+	int i=0;
+	while (q<(qualify+NQUALIFY_SIZE)) {
+		int m=*q++;
+		p+=sprintf(p,"%d:\n",m+1);
+		int l=*q++;
+		int j;
+		for(j=0;j<=l;j++) {
+			if(p-buf>=QBUF) {
+				fwrite(buf,1,p-buf,fp);
+				p=buf;
+			}
+			if(j<l) {
+				p=put_rating(p,8.-err[index[i++]]);
+				q++;
+			}
+		}
+	}
+	if(fwrite(buf,1,p-buf,fp)!=p-buf || fclose(fp))
+		error("Failed to write %s\n",path);
+	free(index);
+	free(buf);
+	free(qualify);
+	lg("Wrote %s in %f sec\n",path,wtime()-wt0);
+}
+
 main(int argc, char**argv) {
 	lgopen(argc,argv);
-	char *fname_inerr[5];
+	char **fname_inerr=malloc(argc*sizeof(char *));
 	int nscores=0;
 	int nweights=0;
-	double weights[100];
+	double *weights=calloc(argc,sizeof(double));
 	char *fname_qualify=NULL;
+	char *fname_outz=NULL;
+	char *fname_outpq=NULL;
+	int zencoding=RESID_F16;
+	int zlz=0;
 	int nloops=10000;
-	int copt=1;
 	int i;
 	for(i=1;i<argc;i++) {
 		int rc=score_argv(argv+i);
@@ -178,6 +323,14 @@ main(int argc, char**argv) {
 			weights[nweights++]=atof(argv[++i]);
 		else if(!strcmp(argv[i],"-se"))
 			fname_outerr=argv[++i];
+		else if(!strcmp(argv[i],"-sez"))
+			fname_outz=argv[++i];
+		else if(!strcmp(argv[i],"-sepq"))
+			fname_outpq=argv[++i];
+		else if(!strcmp(argv[i],"-zq"))
+			zencoding=RESID_Q8;
+		else if(!strcmp(argv[i],"-zlz"))
+			zlz=1;
 		else if(!strcmp(argv[i],"-sq"))
 			fname_qualify=argv[++i];
 		else if(!strcmp(argv[i],"-rm"))
@@ -192,11 +345,23 @@ main(int argc, char**argv) {
 			load_model=1;
 		else if(!strcmp(argv[i],"-sm"))
 			save_model=1;
+		else if(!strcmp(argv[i],"-t"))
+			nthreads=atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-epochs"))
+			maxepochs=atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-prof"))
+			prof_open(0);
+		else if(!strcmp(argv[i],"-perf"))
+			prof_open(1);
 		else {
 			lg("Unrecognized argument %d %s ?\n",i,argv[i]);
 			lg("-le <fname> - load precomputed error file.\n");
 			lg("-lew <weight> - In case of several -le, use wrights, instead of fit\n");
 			lg("-se <fname> - store resulted error file.\n");
+			lg("-sez <fname> - store resulted error file compressed, see resid.c\n");
+			lg("-sepq <fname> - store only the probe and qualify errors.\n");
+			lg("-zq - compress -sez to 8 bits instead of half precision\n");
+			lg("-zlz - also LZ compress -sez\n");
 			lg("-l <n> - number of training loops to perform\n");
 			lg("-a - Perform training also on probe data\n");
 			lg("-c - Dont clip scores to be between 0...4\n");
@@ -204,6 +369,10 @@ main(int argc, char**argv) {
 			lg("-lm - load precomputed model.\n");
 			lg("-sm - save computed model.\n");
 			lg("-rm <fname> - restrict movies to list. Used with integrated model.\n");
+			lg("-t <n> - number of worker threads.\n");
+			lg("-epochs <n> - train exactly n epochs, for timing.\n");
+			lg("-prof - log the time of each training phase per epoch as JSON.\n");
+			lg("-perf - -prof with CPU cycles and cache misses of each phase.\n");
 			exit(0);
 		}
 	}
@@ -211,10 +380,12 @@ main(int argc, char**argv) {
 		lg("WARNING: -sq without -a\n");
 	if(fname_qualify && !copt)
 		lg("WARNING: -sq with -c\n");
+	if(nthreads<1 || nthreads>MAXTHREADS)
+		error("Bad number of threads %d (-t)\n",nthreads);
 	if(nweights && nscores && nweights!=nscores)
 		lg("Number of weights %d (-lew) does not match number of files %d (-le)\n",nweights,nscores);
 	
-	load_bin(useridx_path,useridx,sizeof(useridx));
+	useridx=map_bin(useridx_path,NUSERS*sizeof(*useridx),0);
 	{
 		int count[4],u,k;
 		ZERO(count);
@@ -223,16 +394,24 @@ main(int argc, char**argv) {
 				count[k]+=useridx[u][k];
 		lg("Train=%d Probe=%d Qualify=%d\n",count[1],count[2],count[3]);
 	}	
-	load_bin(userent_path,userent,sizeof(userent));
-	if(nscores) {
-		if(nscores==1)
-			load_bin(fname_inerr[0],err,sizeof(err));
-		else if(nweights)
+	userent=map_bin(userent_path,NENTRIES*sizeof(*userent),0);
+	if(nscores==1) {
+		// copy-on-write: training updates err without touching the file.
+		// Training on it needs its train residuals, so a -sepq file only
+		// goes with -l 0.
+		int mapped;
+		err=load_err(fname_inerr[0],1,nloops>0,&mapped);
+	} else if(nscores) {
+		double wt0=wtime();
+		err=malloc(NENTRIES*sizeof(*err));
+		if(nweights)
 			loadmix(fname_inerr,nscores,weights);
 		else
 			loadmix(fname_inerr,nscores,NULL);
+		lg("Blended %d files in %f sec\n",nscores,wtime()-wt0);
 	} else {
 		int i;
+		err=malloc(NENTRIES*sizeof(*err));
 		for(i=0;i<NENTRIES;i++)
 			err[i]=(userent[i]>>USER_LMOVIEMASK)&7;
 		globalavg();
@@ -252,41 +431,31 @@ main(int argc, char**argv) {
 	for(loop=0;loop<nloops;loop++) {
 		lg("Loop %d\n",loop);
 		clock_t t0=clock();
+		double wt0=wtime();
 		if(!score_train(loop))
 			break;
-		lg("%f sec\n",(clock()-t0)/((double)CLOCKS_PER_SEC));
+		lg("%f sec, %f CPU sec\n",wtime()-wt0,(clock()-t0)/((double)CLOCKS_PER_SEC));
 		if(copt && !dontclip) cliperr();
 		dontclip=0;
 		rmse_print(copt);
 	}
 
-	if(fname_outerr) dump_bin(fname_outerr,err,sizeof(err));
+	if(errstream) {
+		stream_write(errstream,&err[errnext],(NENTRIES-errnext)*sizeof(*err));
+		stream_close(errstream);
+	} else if(fname_outerr)
+		dump_bin(fname_outerr,err,NENTRIES*sizeof(*err));
+	char *model=strrchr(argv[0],'/');
+	model=model ? model+1 : argv[0];
+	if(fname_outz)
+		resid_write(fname_outz,model,err,NENTRIES,zencoding,zlz);
+	if(fname_outpq)
+		resid_write_pq(fname_outpq,model,err);
 
-	if(fname_qualify) {
-		FILE *fp=fopen(fname_qualify,"w");
-		char *qualify_path="data/qualify.bin";
-		unsigned int *qualify=malloc(NQUALIFY_SIZE*4);
-		load_bin(qualify_path,qualify,NQUALIFY_SIZE*4);
-		unsigned int *q=qualify;
-		while (q<(qualify+NQUALIFY_SIZE)) {
-			int m=*q++;
-			fprintf(fp,"%d:\n",m+1);
-			int l=*q++;
-			int j;
-			for(j=0;j<l;j++) {
-				int u=*q++;
-				int base2=useridx[u][0]+useridx[u][1]+useridx[u][2];
-				int d2=+useridx[u][3];
-				int k;
-				for(k=0;k<d2;k++) {
-					if((userent[base2+k]&USER_MOVIEMASK) == m)
-						break;
-					//lg("%d\n",userent[base2+k]&USER_MOVIEMASK);
-				}
-				if(k==d2) error("Bad qualify %d %d\n",m,u);
-				fprintf(fp,"%.1f\n",8.-err[base2+k]);
-			}
-		}
-		fclose(fp);
-	}
+	if(fname_qualify)
+		write_qualify(fname_qualify);
+
+	struct rusage ru;
+	if(!getrusage(RUSAGE_SELF,&ru))
+		lg("Peak RSS %ld MB\n",ru.ru_maxrss/1024);
 }
@@ -18,11 +18,14 @@
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 ########################################################################
 */
-extern int useridx[NUSERS][4];
-extern unsigned int userent[NENTRIES];
-extern float err[NENTRIES];
+extern int (*useridx)[4];
+extern unsigned int *userent;
+extern float *err;
 extern int aopt;
 extern int dontclip;
+extern int nthreads;
+extern int maxepochs;
+void err_stream(int u0, int u1);
 #define UNTRAIN(u)  (aopt?(useridx[u][1]+useridx[u][2]):(useridx[u][1]))
 #define UNALL(u)    (aopt?(useridx[u][1]+useridx[u][2]+useridx[u][3]):(useridx[u][1]+useridx[u][2]))
 #define UNTOTAL(u)  (useridx[u][1]+useridx[u][2]+useridx[u][3])